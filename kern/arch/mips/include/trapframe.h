@@ -106,5 +106,10 @@ __DEAD void mips_usermode(struct trapframe *tf);
 extern vaddr_t cpustacks[];
 extern vaddr_t cputhreads[];
 
+/*
+ * Array used by the UTLB exception handler to find the page tables.
+ */
+extern vaddr_t cpupagetables[];
+
 
 #endif /* _MIPS_TRAPFRAME_H_ */
@@ -120,13 +120,27 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;	/* user page whose mapping is invalidated */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Per-CPU free page cache. Pages move between the cache and the
+ * coremap CPU_PAGECACHE_BATCH at a time.
+ */
+#define CPU_PAGECACHE_SIZE  32
+#define CPU_PAGECACHE_BATCH 16
+
+/* Number of zeroed pages kept ready for user page faults */
+#define ZEROPOOL_SIZE 64
+
+/*
+ * Fault-around window in pages: default and largest allowed. The
+ * window is a power of two so it never crosses a page table.
+ */
+#define FAULTAROUND_DEFAULT 4
+#define FAULTAROUND_MAX     16
+
 
 #endif /* _MIPS_VM_H_ */
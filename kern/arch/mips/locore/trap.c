@@ -39,6 +39,7 @@
 #include <proc.h>
 #include <current.h>
 #include <vm.h>
+#include <addrspace.h>
 #include <mainbus.h>
 #include <syscall.h>
 
@@ -203,6 +204,19 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * Back to user mode, go by way of done so a process
+		 * picked to be killed dies even if it never makes a
+		 * syscall or takes a slow fault (the timer interrupt
+		 * gets here). That needs the stored interrupt state
+		 * in sync, as below.
+		 */
+		if (!iskern) {
+			spl = splhigh();
+			splx(spl);
+			goto done;
+		}
 		goto done2;
 	}
 
@@ -278,8 +292,12 @@ mips_trap(struct trapframe *tf)
 	if (!iskern) {
 		/*
 		 * Fatal fault in user mode.
-		 * Kill the current user process.
+		 * Kill the current user process, the way done does if
+		 * the fault failed for want of memory.
 		 */
+		if (proc_killed()) {
+			goto done;
+		}
 		kill_curthread(tf->tf_epc, code, tf->tf_vaddr);
 		goto done;
 	}
@@ -323,6 +341,15 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * A process picked by the VM system to free memory dies on its
+	 * way back to user mode.
+	 */
+	if (!iskern && proc_killed()) {
+		proc_exit(_MKWAIT_SIG(SIGKILL));
+		thread_exit();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
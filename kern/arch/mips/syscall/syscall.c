@@ -119,6 +119,10 @@ syscall(struct trapframe *tf)
 		err = sys_fork(tf, &retval);
 		break;
 
+	    case SYS_vfork:
+		err = sys_vfork(tf, &retval);
+		break;
+
 	    case SYS_execv:
 		err = sys_execv(
 			(userptr_t)tf->tf_a0,
@@ -209,6 +213,10 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+	    case SYS_fsync:
+		err = sys_fsync(tf->tf_a0);
+		break;
+
 	    case SYS_chdir:
 		err = sys_chdir((userptr_t)tf->tf_a0);
 		break;
@@ -221,6 +229,53 @@ syscall(struct trapframe *tf)
 		break;
 
 
+	    /* vm calls */
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits wide and a0-a2 are
+			 * taken, so it is on the stack.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(offset));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap(
+				tf->tf_a0,
+				tf->tf_a1,
+				tf->tf_a2,
+				offset,
+				&retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1);
+		break;
+
+	    case SYS_getrusage:
+		err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_getrlimit:
+		err = sys_getrlimit(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_setrlimit:
+		err = sys_setrlimit(tf->tf_a0, (const_userptr_t)tf->tf_a1);
+		break;
+
 	    /* Even more system calls will go here */
 
 
@@ -59,6 +59,13 @@
 vaddr_t cpustacks[MAXCPUS];
 vaddr_t cputhreads[MAXCPUS];
 
+/*
+ * Page directory of the address space active on each cpu, for the
+ * TLB refill fast path in the UTLB exception handler. Set by
+ * as_activate; 0 if there is none.
+ */
+vaddr_t cpupagetables[MAXCPUS];
+
 /*
  * Do machine-dependent initialization of the cpu structure or things
  * associated with a new cpu. Note that we're not running on the new
@@ -34,9 +34,20 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
+#include <thread.h>
+#include <wchan.h>
+#include <synch.h>
+#include <kern/resource.h>
+#include <clock.h>
+#include <uio.h>
+#include <vnode.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <vmstats.h>
 
 /*
  * Wrap ram_stealmem in a spinlock.
@@ -45,7 +56,153 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 struct coremap cm; /* Keep track of physical memory */ 
 volatile int coremap_pages; /* Number of pages being tracked by coremap */
 struct spinlock cm_lock;
+static struct wchan *cm_wchan; /* Wait here for pages being written to swap */
+static int cm_clockhand; /* Next coremap entry looked at by the clock */
+static paddr_t zero_page; /* Mapped read only by untouched anonymous pages */
+static unsigned faultaround_pages = FAULTAROUND_DEFAULT; /* See vm_fault_around */
 
+/* Seconds a process picked to be killed for memory gets to go away */
+#define VM_OOM_WAIT 1
+static struct timespec oom_marked; /* When it was picked, under cm_lock */
+
+/* Pages zeroed ahead of time by idle CPUs (see vm_idle_zero) */
+static int zeropool[ZEROPOOL_SIZE];
+static unsigned zeropool_count;
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+
+/* Only one shootdown at a time, so each reply is for our request */
+static struct lock *shootdown_lock;
+static struct semaphore *shootdown_sem;
+
+/* Same for asking the other CPUs to empty their page caches */
+static struct lock *pagecache_lock;
+static struct semaphore *pagecache_sem;
+
+
+/*
+* Buddy allocator over the coremap
+* Free memory is kept as blocks of 2^order pages aligned to their size,
+* with a doubly linked free list per order threaded through the coremap
+* entries. Only the first page of a free block has its order set.
+*/
+static void buddy_push(int index, int order)
+{
+	struct cm_entry *e = &cm.cm_entries[index];
+
+	e->order = order;
+	e->prev_free = -1;
+	e->next_free = cm.free_heads[order];
+	if (e->next_free != -1)
+	{
+		cm.cm_entries[e->next_free].prev_free = index;
+	}
+	cm.free_heads[order] = index;
+}
+
+static void buddy_remove(int index)
+{
+	struct cm_entry *e = &cm.cm_entries[index];
+
+	if (e->prev_free != -1)
+	{
+		cm.cm_entries[e->prev_free].next_free = e->next_free;
+	}
+	else
+	{
+		cm.free_heads[e->order] = e->next_free;
+	}
+	if (e->next_free != -1)
+	{
+		cm.cm_entries[e->next_free].prev_free = e->prev_free;
+	}
+	e->order = -1;
+}
+
+/* Give a block back to the free lists, merging it with its free buddies */
+static void buddy_free_block(int index, int order)
+{
+	while (order < BUDDY_ORDERS - 1)
+	{
+		int buddy = index ^ (1 << order);
+
+		if (buddy + (1 << order) > coremap_pages || cm.cm_entries[buddy].order != order)
+		{
+			break;
+		}
+
+		buddy_remove(buddy);
+		if (buddy < index)
+		{
+			index = buddy;
+		}
+		order++;
+	}
+
+	buddy_push(index, order);
+}
+
+/* Free npages starting at index by splitting them into aligned blocks */
+static void buddy_free_range(int index, int npages)
+{
+	while (npages > 0)
+	{
+		int order = 0;
+
+		while (order < BUDDY_ORDERS - 1 && (index & (1 << order)) == 0 && (2 << order) <= npages)
+		{
+			order++;
+		}
+
+		buddy_free_block(index, order);
+		index += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+/*
+* Take npages from the free lists
+* The smallest block that fits is split down to the right order and
+* the pages past npages are freed again
+* Return the index of the first page, -1 if there is no block big enough
+*/
+static int buddy_alloc(int npages)
+{
+	int order = 0;
+	int o, index;
+
+	while ((1 << order) < npages)
+	{
+		order++;
+	}
+
+	for (o = order; o < BUDDY_ORDERS; o++)
+	{
+		if (cm.free_heads[o] != -1)
+		{
+			break;
+		}
+	}
+	if (o >= BUDDY_ORDERS)
+	{
+		return -1;
+	}
+
+	index = cm.free_heads[o];
+	buddy_remove(index);
+
+	while (o > order)
+	{
+		o--;
+		buddy_push(index + (1 << o), o);
+	}
+
+	if ((1 << order) > npages)
+	{
+		buddy_free_range(index + npages, (1 << order) - npages);
+	}
+
+	return index;
+}
 
 void coremap_init()
 {
@@ -68,20 +225,65 @@ void coremap_init()
 	{
 		cm_entry.is_free = true;
 		cm_entry.is_end_malloc = true;
+		cm_entry.is_busy = false;
+		cm_entry.refcount = 0;
+		cm_entry.as = NULL;
+		cm_entry.vaddr = 0;
+		cm_entry.order = -1;
+		cm_entry.next_free = -1;
+		cm_entry.prev_free = -1;
+		cm_entry.kheap = NULL;
 		memmove(&cm.cm_entries[i], &cm_entry, sizeof(cm_entry));
 	}
 
-	/* Mark pages used by kernel and coremap as not free */
+	/* 
+	*  Mark pages used by kernel and coremap as not free 
+	*  Each one counts as a single page allocation in case it is
+	*  kfree'd later on
+	*/
 	uint32_t i;
 	for (i = 0; i < (firstpaddr + (coremap_pages * sizeof(struct cm_entry))) / PAGE_SIZE + 1; i++)
 	{
 		cm.cm_entries[i].is_free = false;
+		cm.cm_entries[i].refcount = 1;
+	}
+
+	/* Everything else goes on the buddy free lists */
+	for (int order = 0; order < BUDDY_ORDERS; order++)
+	{
+		cm.free_heads[order] = -1;
 	}
+	buddy_free_range(i, coremap_pages - i);
 }
 
 void vm_bootstrap(void)
 {
 	coremap_init();
+	kheap_indexpages();
+
+	cm_wchan = wchan_create("coremap");
+	shootdown_lock = lock_create("tlbshootdown");
+	shootdown_sem = sem_create("tlbshootdown", 0);
+	pagecache_lock = lock_create("pagecache");
+	pagecache_sem = sem_create("pagecache", 0);
+	if (cm_wchan == NULL || shootdown_lock == NULL || shootdown_sem == NULL ||
+	    pagecache_lock == NULL || pagecache_sem == NULL)
+	{
+		panic("vm_bootstrap: out of memory\n");
+	}
+
+	/*
+	*  The kernel keeps a reference to the zero page, so it is never
+	*  claimed by a single mapping and never freed
+	*/
+	vaddr_t kvaddr = alloc_kpages(1);
+	if (kvaddr == 0)
+	{
+		panic("vm_bootstrap: out of memory\n");
+	}
+	zero_page = KVADDR_TO_PADDR(kvaddr);
+
+	swap_bootstrap();
 }
 
 paddr_t getppages(unsigned long npages)
@@ -97,251 +299,1387 @@ paddr_t getppages(unsigned long npages)
 }
 
 /*
-* Find the free space in coremap that fits npages
-* Return the index of the first page in the free space
-* Return -1 if no free space is found
+* Find the page table entry for vaddr
+* Create the 2nd level page table if create is set and it does not exist yet
+* Return NULL if there is no page table (or it could not be allocated)
 */
-int find_free_space(int npages)
+static paddr_t *pte_lookup(struct pagedirectory *pd, vaddr_t vaddr, bool create)
 {
-	int free_pages = 0;
-	int start_index = -1;
-	for (int i = 0; i < coremap_pages; i++)
+	unsigned int msb = PD_INDEX(vaddr);
+	unsigned int mid = PT_INDEX(vaddr);
+
+	/* Create 2nd level page table if it is not yet created */
+	if (pd->pagetables[msb] == NULL)
 	{
-		if (cm.cm_entries[i].is_free)
+		if (!create)
 		{
-			if (start_index == -1)
-			{
-				start_index = i;
-			}
-			free_pages++;
-			if (free_pages == npages)
-			{
-				return start_index;
-			}
+			return NULL;
 		}
-		else
+
+		pd->pagetables[msb] = kmalloc(sizeof(struct pagetable));
+		if (pd->pagetables[msb] == NULL)
 		{
-			free_pages = 0;
-			start_index = -1;
+			return NULL;
 		}
-	}
-	return -1;
-} 
 
-/* Allocate some kernel-space virtual pages */
-vaddr_t
-alloc_kpages(unsigned npages)
-{
-	paddr_t paddr;
-	/* If coremap is not initialized use ram_stealmem*/
-	if (cm.cm_entries == NULL)
-	{
-		paddr = getppages(npages);
+		/* Initialize 2nd level page table */
+		for (int i = 0; i < PAGE_TABLE_ENTRIES; i++)
+		{
+			pd->pagetables[msb]->entries[i] = 0;
+		}
 	}
-	else
-	{
-		spinlock_acquire(&cm_lock);
 
-		int first_free_index = find_free_space(npages);
+	return &pd->pagetables[msb]->entries[mid];
+}
 
-		if (first_free_index == -1)
-		{
-			spinlock_release(&cm_lock);
-			return 0;
-		}
+/* Eviction and page cache draining sleep, so they can only be done where sleeping is allowed */
+static bool vm_can_sleep(void)
+{
+	return !curthread->t_in_interrupt && curthread->t_curspl == 0 && curcpu->c_spinlocks == 0;
+}
 
-		paddr = first_free_index * PAGE_SIZE;
+/*
+* Per-CPU cache of free single pages in front of the buddy allocator
+* Cached pages are marked free but are not on the buddy free lists.
+* Each CPU only touches its own cache, with interrupts off, and goes to
+* cm_lock once per CPU_PAGECACHE_BATCH pages to refill or drain it.
+* Return the index of the page, -1 if there is no free page left.
+*/
+static int cpucache_get(void)
+{
+	struct cpu *c;
+	int index = -1;
+	int spl;
 
-		for (int i = first_free_index; i < first_free_index + (int) npages; i++)
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	if (c->c_npagecache == 0)
+	{
+		spinlock_acquire(&cm_lock);
+		while (c->c_npagecache < CPU_PAGECACHE_BATCH)
 		{
-			cm.cm_entries[i].is_free = false;
-			cm.cm_entries[i].is_end_malloc = false;
+			int i = buddy_alloc(1);
+			if (i == -1)
+			{
+				break;
+			}
+			c->c_pagecache[c->c_npagecache++] = i;
 		}
-		
-		/* Set last entry as final page of allocation block*/
-		cm.cm_entries[first_free_index + (int) npages - 1].is_end_malloc = true;
-
 		spinlock_release(&cm_lock);
 	}
 
-	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	if (c->c_npagecache > 0)
+	{
+		index = c->c_pagecache[--c->c_npagecache];
+		cm.cm_entries[index].is_free = false;
+		cm.cm_entries[index].is_end_malloc = true;
+		cm.cm_entries[index].refcount = 1;
+	}
 
-	return PADDR_TO_KVADDR(paddr);
+	splx(spl);
+	return index;
 }
 
-/* Free some kernel-space virtual pages */
-void free_kpages(vaddr_t addr)
+static void cpucache_put(int index)
 {
-	paddr_t paddr = KVADDR_TO_PADDR(addr);
+	struct cpu *c;
+	int spl;
 
-	spinlock_acquire(&cm_lock);
+	KASSERT(!cm.cm_entries[index].is_free);
+	KASSERT(cm.cm_entries[index].refcount == 1);
+	KASSERT(cm.cm_entries[index].as == NULL);
 
-	int index = paddr / PAGE_SIZE;
+	spl = splhigh();
+	c = curcpu->c_self;
 
-	/* Free all successive pages until the final page of an allocation block*/
-	while(!cm.cm_entries[index].is_free)
+	cm.cm_entries[index].refcount = 0;
+	cm.cm_entries[index].is_free = true;
+
+	if (c->c_npagecache == CPU_PAGECACHE_SIZE)
 	{
-		cm.cm_entries[index].is_free = true;
-		if(cm.cm_entries[index].is_end_malloc)
+		spinlock_acquire(&cm_lock);
+		while (c->c_npagecache > CPU_PAGECACHE_SIZE - CPU_PAGECACHE_BATCH)
 		{
-			break;
+			buddy_free_block(c->c_pagecache[--c->c_npagecache], 0);
 		}
-		index++;
+		spinlock_release(&cm_lock);
 	}
 
-	spinlock_release(&cm_lock);
+	c->c_pagecache[c->c_npagecache++] = index;
+
+	splx(spl);
 }
 
-void vm_tlbshootdown_all(void)
+/* Give all of this CPU's cached pages back to the buddy lists */
+static void cpucache_drain(void)
 {
-	panic("vm tried to do tlb shootdown and it is not implemented\n");
+	struct cpu *c;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	if (c->c_npagecache > 0)
+	{
+		spinlock_acquire(&cm_lock);
+		while (c->c_npagecache > 0)
+		{
+			buddy_free_block(c->c_pagecache[--c->c_npagecache], 0);
+		}
+		spinlock_release(&cm_lock);
+	}
+
+	splx(spl);
 }
 
-void vm_tlbshootdown(const struct tlbshootdown *ts)
+/* IPI_PAGECACHE handler; only one drain is asked for at a time */
+void vm_pagecache_drain(void)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown and it is not implemented\n");
-
+	cpucache_drain();
+	V(pagecache_sem);
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress)
+/*
+* Put the pages cached by every CPU back on the buddy lists, so they
+* can be had by this CPU and merged into bigger blocks
+* The other CPUs are only asked (and waited for) if we can sleep.
+*/
+static void cpucache_reclaim(void)
 {
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
-	struct addrspace *as;
-	int spl;
+	unsigned sent;
 
-	faultaddress &= PAGE_FRAME;
+	cpucache_drain();
 
-	switch (faulttype)
+	if (!vm_can_sleep() || cpu_count() == 1)
 	{
-	case VM_FAULT_READONLY:
-	case VM_FAULT_READ:
-	case VM_FAULT_WRITE:
-		break;
-	default:
-		return EINVAL;
+		return;
 	}
 
-	if (curproc == NULL)
+	lock_acquire(pagecache_lock);
+	ipi_broadcast(IPI_PAGECACHE);
+	for (sent = cpu_count() - 1; sent > 0; sent--)
 	{
-		/*
-		 * No process. This is probably a kernel fault early
-		 * in boot. Return EFAULT so as to panic instead of
-		 * getting into an infinite faulting loop.
-		 */
-		return EFAULT;
+		P(pagecache_sem);
 	}
+	lock_release(pagecache_lock);
+}
 
-	as = proc_getas();
-	if (as == NULL)
+/*
+* Take a page from the pre-zeroed pool
+* Pool pages are allocated like a single page from alloc_kpages.
+* Return the index of the page, -1 if the pool is empty.
+*/
+static int zeropool_get(void)
+{
+	int index = -1;
+
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count > 0)
 	{
-		/*
-		 * No address space set up. This is probably also a
-		 * kernel fault early in boot.
-		 */
-		return EFAULT;
+		index = zeropool[--zeropool_count];
 	}
+	spinlock_release(&zeropool_lock);
 
-	/* 
-	*  Extract the 10 most significant bits of fault address 
-	*  Used as index for 1st level page table (page directory)
-	*/
-	unsigned int msb = (faultaddress >> 22) & 0x3FF; // 0x3FF is the mask for 10 bits
-
-	/* 
-	*  Extract the 10 middle bits of fault address 
-	*  Used as index for 2nd level page table
-	*/
-	unsigned int mid = (faultaddress >> 12) & 0x3FF; // Shift right by 12 and mask
+	return index;
+}
 
-	struct pagedirectory *pd = as->pd;
+/*
+* Top up the pre-zeroed pool by one page
+* Called by idle CPUs with interrupts off, so each call only does one
+* page before the run queue gets looked at again. Pages come from this
+* CPU's free cache; nothing is evicted to fill the pool.
+* The page is claimed with interrupts off but zeroed with them on, the
+* way cpu_idle lets them in, so interrupts aren't held off for a whole
+* page. The page isn't in the pool or the cache meanwhile, so nobody
+* else can get at it.
+*/
+bool vm_idle_zero(void)
+{
+	int index;
 
-	/* Create 2nd level page table if it is not yet created */
-	if (pd->pagetables[msb] == NULL)
+	if (cm.cm_entries == NULL || zeropool_count >= ZEROPOOL_SIZE)
 	{
-		pd->pagetables[msb] = kmalloc(sizeof(struct pagetable));
-		if (pd->pagetables[msb] == NULL)
-		{
-			return ENOMEM;
-		}
-
-		/* Initialize 2nd level page table */
-		for (int i = 0; i < PAGE_TABLE_ENTRIES; i++)
-		{
-			pd->pagetables[msb]->entries[i] = 0;
-		}
+		return false;
 	}
 
-	/* Check if page is in page table */
-	if (pd->pagetables[msb]->entries[mid] == 0)
+	index = cpucache_get();
+	if (index == -1)
 	{
-		struct region *region = as->regions;
+		return false;
+	}
 
-		while (region != NULL)
-		{
-			/* Check if fault address is within region */
-			if (faultaddress >= region->vbase && faultaddress <= (region->vbase + region->npages * PAGE_SIZE))
-			{
-				/* Allocate new physical page */
-				vaddr_t new_page = alloc_kpages(1);
-				if (new_page == 0)
-				{
-					return ENOMEM;
-				}
+	cpu_irqon();
+	bzero((void *)PADDR_TO_KVADDR(index * PAGE_SIZE), PAGE_SIZE);
+	cpu_irqoff();
 
-				/* Add new page translation to page table */
-				if (region->writeable)
-				{
-					pd->pagetables[msb]->entries[mid] = PADDR_TO_KVADDR(new_page & PAGE_FRAME) | TLBLO_DIRTY | TLBLO_VALID;
-				}
-				else
-				{
-					pd->pagetables[msb]->entries[mid] = PADDR_TO_KVADDR(new_page & PAGE_FRAME) | 0 | TLBLO_VALID;
-				}
-				paddr = pd->pagetables[msb]->entries[mid];
-				region = NULL;
-			}
-			else
-			{
-				region = region->next;
-			}
-		}
+	spinlock_acquire(&zeropool_lock);
+	if (zeropool_count < ZEROPOOL_SIZE)
+	{
+		zeropool[zeropool_count++] = index;
+		index = -1;
+	}
+	spinlock_release(&zeropool_lock);
 
-		/*
-		*  If fault address is not within any valid region
-		*  so no page was allocated 
-		*  return EFAULT to indicate invalid memory
-		*/
-		if (pd->pagetables[msb]->entries[mid] == 0)
-		{
-			return EFAULT;
-		}
-	}else{
-		paddr = pd->pagetables[msb]->entries[mid];
+	if (index != -1)
+	{
+		/* Someone else filled it first */
+		cpucache_put(index);
+		return false;
 	}
+	return true;
+}
+
+/* Coremap entry of the page held by a resident page table entry */
+static struct cm_entry *pte_entry(paddr_t pte)
+{
+	return &cm.cm_entries[(pte & PAGE_FRAME) / PAGE_SIZE];
+}
+
+/* Whether an entry counts toward the resident set (the zero page doesn't) */
+static bool pte_resident(paddr_t pte)
+{
+	return (pte & PTE_PRESENT) && (pte & PAGE_FRAME) != zero_page;
+}
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
+/*
+* Invalidate the translation for vaddr in this CPU's TLB, if there is one
+*/
+static void tlb_invalidate(vaddr_t vaddr)
+{
+	int i, spl;
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i = 0; i < NUM_TLB; i++)
+	i = tlb_probe(vaddr, 0);
+	if (i >= 0)
 	{
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID)
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	splx(spl);
+}
+
+/*
+* Remove the translations of num pages from the TLB of every CPU
+* Each other CPU gets the whole batch with a single IPI. Past
+* TLBSHOOTDOWN_MAX pages the TLBs are flushed instead and only the
+* first TLBSHOOTDOWN_MAX entries of ts need to be filled in.
+* Returns once all other CPUs are done
+*/
+static void tlb_shootdown(const struct tlbshootdown *ts, unsigned num)
+{
+	unsigned sent;
+	int spl;
+
+	lock_acquire(shootdown_lock);
+
+	/* Stay on this CPU between the local invalidate and sending the IPIs */
+	spl = splhigh();
+	if (num > TLBSHOOTDOWN_MAX)
+	{
+		vm_tlbflush();
+	}
+	else
+	{
+		for (unsigned i = 0; i < num; i++)
+		{
+			tlb_invalidate(ts[i].ts_vaddr);
+		}
+	}
+	sent = ipi_tlbshootdown_broadcast(ts, num);
+	splx(spl);
+
+	vmstats_inc(VMSTAT_SHOOTDOWN);
+	for (unsigned i = 0; i < sent; i++)
+	{
+		vmstats_inc(VMSTAT_SHOOTDOWN_IPI);
+	}
+
+	while (sent > 0)
+	{
+		P(shootdown_sem);
+		sent--;
+	}
+
+	lock_release(shootdown_lock);
+}
+
+/* Make sure the page of a resident entry is not being written to swap */
+static void pte_wait(paddr_t *pte)
+{
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	while ((*pte & PTE_PRESENT) && pte_entry(*pte)->is_busy)
+	{
+		wchan_sleep(cm_wchan, &cm_lock);
+	}
+}
+
+/*
+* Drop a reference to the block starting at index, as removes its mapping
+* The block is freed once the last reference goes away
+*/
+static void coremap_release(int index, struct addrspace *as)
+{
+	struct cm_entry *e = &cm.cm_entries[index];
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+	KASSERT(!e->is_free);
+	KASSERT(e->refcount > 0);
+
+	/* Whoever is left mapping the page has to claim it again in vm_fault */
+	if (e->as == as)
+	{
+		e->as = NULL;
+	}
+
+	e->refcount--;
+	if (e->refcount > 0)
+	{
+		return;
+	}
+
+	/* Free all successive pages until the final page of an allocation block*/
+	int npages = 0;
+	while(!cm.cm_entries[index + npages].is_free)
+	{
+		cm.cm_entries[index + npages].is_free = true;
+		npages++;
+		if(cm.cm_entries[index + npages - 1].is_end_malloc)
+		{
+			break;
+		}
+	}
+
+	buddy_free_range(index, npages);
+}
+
+/*
+* Page out a user page picked by the clock algorithm
+* A page whose TLBLO_VALID bit is set was used since the clock last went
+* past it, so it loses the bit and gets a second chance. The TLB entries
+* of those pages go in the same shootdown as the victim's, so a page in
+* use on another CPU faults and gets its bit back. Only pages with
+* a single mapping are considered, only those of address space only if
+* it is not NULL.
+* Returns the index of the evicted page, which is handed to the caller
+* still allocated, or -1 if no page could be evicted. If the compressed
+* swap pool kept the page to grow, pooled is set and the page is the
+* pool's instead.
+*/
+static int coremap_evict_page(struct addrspace *only, bool *pooled)
+{
+	struct cm_entry *e = NULL;
+	paddr_t *pte = NULL;
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	unsigned nts = 0;
+	unsigned slot;
+	int index = -1;
+	int result;
+
+	/* No point looking for a victim if it can't go anywhere */
+	if (swap_alloc(&slot))
+	{
+		return -1;
+	}
+
+	spinlock_acquire(&cm_lock);
+
+	/* The first sweep may only clear reference bits */
+	for (int scanned = 0; scanned < 2 * coremap_pages; scanned++)
+	{
+		int i = cm_clockhand;
+		cm_clockhand = (cm_clockhand + 1) % coremap_pages;
+
+		e = &cm.cm_entries[i];
+		if (e->is_free || e->is_busy || e->as == NULL || e->refcount != 1)
+		{
+			continue;
+		}
+		if (only != NULL && e->as != only)
+		{
+			continue;
+		}
+
+		pte = pte_lookup(e->as->pd, e->vaddr, false);
+		KASSERT(pte != NULL);
+		KASSERT((*pte & PTE_PRESENT) && pte_entry(*pte) == e);
+
+		if (*pte & TLBLO_VALID)
+		{
+			*pte &= ~(paddr_t)TLBLO_VALID;
+			if (nts < TLBSHOOTDOWN_MAX)
+			{
+				ts[nts].ts_vaddr = e->vaddr;
+			}
+			nts++;
+			continue;
+		}
+
+		index = i;
+		break;
+	}
+
+	if (index == -1)
+	{
+		spinlock_release(&cm_lock);
+		if (nts > 0)
+		{
+			tlb_shootdown(ts, nts);
+		}
+		swap_free(slot);
+		return -1;
+	}
+
+	/* Faults on the page wait until it is written out */
+	e->is_busy = true;
+	if (nts < TLBSHOOTDOWN_MAX)
+	{
+		ts[nts].ts_vaddr = e->vaddr;
+	}
+	nts++;
+	spinlock_release(&cm_lock);
+
+	tlb_shootdown(ts, nts);
+	result = swap_out(index * PAGE_SIZE, slot, pooled);
+
+	spinlock_acquire(&cm_lock);
+	e->is_busy = false;
+	if (result == 0)
+	{
+		*pte = PTE_MKSWAP(slot);
+		e->as->as_rss--;
+		e->as->as_nswap++;
+		e->as = NULL;
+		vmstats_inc(VMSTAT_EVICT);
+	}
+	wchan_wakeall(cm_wchan, &cm_lock);
+	spinlock_release(&cm_lock);
+
+	if (result)
+	{
+		swap_free(slot);
+		return -1;
+	}
+	return index;
+}
+
+/*
+* Evict pages until one is left for the caller
+* Pages kept by the swap pool each make room for several more, and the
+* pool stops growing at its limit, so this doesn't go on for long.
+*/
+static int coremap_evict(struct addrspace *only)
+{
+	bool pooled;
+	int index;
+
+	do
+	{
+		index = coremap_evict_page(only, &pooled);
+	} while (index != -1 && pooled);
+
+	return index;
+}
+
+/*
+* Take npages free pages, single pages from this CPU's cache
+* Return the index of the first page, -1 if there is no block big enough
+*/
+static int kpages_get(unsigned npages)
+{
+	int first_free_index;
+
+	if (npages == 1)
+	{
+		return cpucache_get();
+	}
+
+	spinlock_acquire(&cm_lock);
+
+	first_free_index = buddy_alloc(npages);
+	if (first_free_index != -1)
+	{
+		for (int i = first_free_index; i < first_free_index + (int) npages; i++)
+		{
+			cm.cm_entries[i].is_free = false;
+			cm.cm_entries[i].is_end_malloc = false;
+		}
+
+		/* Set last entry as final page of allocation block*/
+		cm.cm_entries[first_free_index + (int) npages - 1].is_end_malloc = true;
+
+		/* The block starts out with a single owner */
+		cm.cm_entries[first_free_index].refcount = 1;
+	}
+
+	spinlock_release(&cm_lock);
+
+	return first_free_index;
+}
+
+/* Allocate some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t paddr;
+	/* If coremap is not initialized use ram_stealmem*/
+	if (cm.cm_entries == NULL)
+	{
+		paddr = getppages(npages);
+	}
+	else
+	{
+		int first_free_index = kpages_get(npages);
+
+		if (first_free_index == -1)
+		{
+			/* Other CPUs may be sitting on free pages */
+			cpucache_reclaim();
+			first_free_index = kpages_get(npages);
+		}
+
+		if (first_free_index == -1 && npages == 1)
+		{
+			/* Low on memory, use up the pre-zeroed pool before evicting */
+			first_free_index = zeropool_get();
+		}
+
+		if (first_free_index == -1)
+		{
+			/* Out of memory, take the page of someone who can go to swap */
+			if (npages != 1 || !vm_can_sleep())
+			{
+				return 0;
+			}
+
+			first_free_index = coremap_evict(NULL);
+			if (first_free_index == -1)
+			{
+				return 0;
+			}
+		}
+
+		paddr = first_free_index * PAGE_SIZE;
+	}
+
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+
+	return PADDR_TO_KVADDR(paddr);
+}
+
+/*
+* Drop a reference to some kernel-space virtual pages
+* The block is freed once the last reference goes away
+*/
+void free_kpages(vaddr_t addr)
+{
+	paddr_t paddr = KVADDR_TO_PADDR(addr);
+	int index = paddr / PAGE_SIZE;
+
+	/*
+	*  Pages handed to free_kpages have a single owner, so single pages
+	*  can go straight back to this CPU's cache
+	*/
+	if (cm.cm_entries[index].is_end_malloc)
+	{
+		cpucache_put(index);
+		return;
+	}
+
+	spinlock_acquire(&cm_lock);
+	coremap_release(index, NULL);
+	spinlock_release(&cm_lock);
+}
+
+/*
+* Allocate a zeroed physical page to back a user page
+* Pages zeroed ahead of time are used first
+*/
+paddr_t alloc_upage(void)
+{
+	int index = zeropool_get();
+	if (index != -1)
+	{
+		vmstats_inc(VMSTAT_ZERO_HIT);
+		return index * PAGE_SIZE;
+	}
+	vmstats_inc(VMSTAT_ZERO_MISS);
+
+	vaddr_t kvaddr = alloc_kpages(1);
+	if (kvaddr == 0)
+	{
+		return 0;
+	}
+	return KVADDR_TO_PADDR(kvaddr);
+}
+
+/* Free a page that was never mapped */
+void free_upage(paddr_t paddr)
+{
+	free_kpages(PADDR_TO_KVADDR(paddr));
+}
+
+/* Add a reference to a physical page (used by the page cache) */
+void coremap_incref(paddr_t paddr)
+{
+	int index = paddr / PAGE_SIZE;
+
+	spinlock_acquire(&cm_lock);
+	KASSERT(!cm.cm_entries[index].is_free);
+	KASSERT(cm.cm_entries[index].refcount > 0);
+	cm.cm_entries[index].refcount++;
+	spinlock_release(&cm_lock);
+}
+
+/*
+* Record what kmalloc uses a kernel page for
+* Only kmalloc changes it, while it owns the page, so no lock is needed
+*/
+void coremap_setkheap(vaddr_t page, void *kheap)
+{
+	if (cm.cm_entries != NULL)
+	{
+		cm.cm_entries[KVADDR_TO_PADDR(page) / PAGE_SIZE].kheap = kheap;
+	}
+}
+
+void *coremap_getkheap(vaddr_t page)
+{
+	KASSERT(cm.cm_entries != NULL);
+	return cm.cm_entries[KVADDR_TO_PADDR(page) / PAGE_SIZE].kheap;
+}
+
+/* Release the page or swap slot of a page table entry */
+void pte_free(struct addrspace *as, paddr_t *pte)
+{
+	spinlock_acquire(&cm_lock);
+
+	pte_wait(pte);
+	if (*pte & PTE_PRESENT)
+	{
+		if (pte_resident(*pte))
+		{
+			as->as_rss--;
+		}
+		coremap_release((*pte & PAGE_FRAME) / PAGE_SIZE, as);
+	}
+	else if (*pte & PTE_SWAPPED)
+	{
+		swap_free(PTE_SWAPSLOT(*pte));
+	}
+	*pte = 0;
+
+	spinlock_release(&cm_lock);
+}
+
+/*
+* Copy a page table entry for fork
+* Resident pages are shared copy-on-write: both entries lose TLBLO_DIRTY
+* and vm_fault gives each side its own copy on the first write
+*/
+int pte_copy(paddr_t *oldpte, struct addrspace *newas, paddr_t *newpte)
+{
+	paddr_t pte;
+	unsigned slot;
+	int result;
+
+	spinlock_acquire(&cm_lock);
+
+	pte_wait(oldpte);
+	pte = *oldpte;
+	if (pte & PTE_PRESENT)
+	{
+		pte &= ~(paddr_t)TLBLO_DIRTY;
+		*oldpte = pte;
+		pte_entry(pte)->refcount++;
+		*newpte = pte;
+		if (pte_resident(pte))
+		{
+			newas->as_rss++;
+		}
+		spinlock_release(&cm_lock);
+		return 0;
+	}
+
+	spinlock_release(&cm_lock);
+
+	/* Swap slots can't be shared, copy it */
+	if (pte & PTE_SWAPPED)
+	{
+		result = swap_dup(PTE_SWAPSLOT(pte), &slot);
+		if (result)
+		{
+			return result;
+		}
+		*newpte = PTE_MKSWAP(slot);
+		return 0;
+	}
+
+	*newpte = 0;
+	return 0;
+}
+
+/* Revoke write permission on a resident page */
+void pte_writeprotect(paddr_t *pte)
+{
+	spinlock_acquire(&cm_lock);
+	*pte &= ~(paddr_t)TLBLO_DIRTY;
+	spinlock_release(&cm_lock);
+}
+
+void vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+
+	splx(spl);
+}
+
+/*
+* Shootdown handlers, called once per IPI
+* Only one shootdown is sent at a time, so each IPI answers it once
+*/
+void vm_tlbshootdown_all(void)
+{
+	vm_tlbflush();
+	vmstats_inc(VMSTAT_SHOOTDOWN_ALL);
+	V(shootdown_sem);
+}
+
+void vm_tlbshootdown(const struct tlbshootdown *ts, int num)
+{
+	for (int i = 0; i < num; i++)
+	{
+		tlb_invalidate(ts[i].ts_vaddr);
+	}
+	V(shootdown_sem);
+}
+
+/* Whether the page at vaddr holds any data of the region's executable */
+static bool vm_file_page(struct region *region, vaddr_t vaddr)
+{
+	return region->vn != NULL && vaddr < region->vn_start + region->vn_filesz && vaddr + PAGE_SIZE > region->vn_start;
+}
+
+/* Whether the page at vaddr is a whole page of the executable to share */
+static bool vm_cached_page(struct region *region, vaddr_t vaddr)
+{
+	return region->vn_cached && vaddr >= region->vn_start && vaddr + PAGE_SIZE <= region->vn_start + region->vn_filesz;
+}
+
+/*
+* Read the part of the executable that goes in the page at vaddr into the
+* (zeroed) physical page paddr
+*/
+static int vm_read_file(struct region *region, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	start = vaddr > region->vn_start ? vaddr : region->vn_start;
+	end = region->vn_start + region->vn_filesz;
+	if (end > vaddr + PAGE_SIZE)
+	{
+		end = vaddr + PAGE_SIZE;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr + (start - vaddr)), end - start,
+		  region->vn_offset + (start - region->vn_start), UIO_READ);
+	result = VOP_READ(region->vn, &ku);
+	if (result)
+	{
+		return result;
+	}
+	if (ku.uio_resid != 0)
+	{
+		/* The executable was truncated after exec looked at it */
+		return EFAULT;
+	}
+	return 0;
+}
+
+/*
+* Out of memory and swap: mark the address space with the most resident
+* pages to be killed (see mips_trap)
+* The victim dies on its next return to user mode, and is woken if it
+* is in an interruptible sleep. One that is still around VM_OOM_WAIT
+* seconds later may be stuck, so the next largest is picked then.
+* If as itself is the largest it is marked too, and the fault fails.
+* Returns true if the caller should wait for a victim to go away and try
+* again, false if it should give up.
+*/
+static bool vm_oom_kill(struct addrspace *as)
+{
+	struct addrspace *victim = NULL;
+	struct timespec now, waited;
+	bool dying = false;
+
+	if (as->as_oomkill)
+	{
+		return false;
+	}
+
+	gettime(&now);
+
+	/* Every address space with pages of its own owns some coremap entry */
+	spinlock_acquire(&cm_lock);
+	for (int i = 0; i < coremap_pages; i++)
+	{
+		struct addrspace *owner = cm.cm_entries[i].as;
+		if (owner == NULL)
+		{
+			continue;
+		}
+		if (owner->as_oomkill)
+		{
+			dying = true;
+		}
+		else if (victim == NULL || owner->as_rss > victim->as_rss)
+		{
+			victim = owner;
+		}
+	}
+	timespec_sub(&now, &oom_marked, &waited);
+	if (dying && waited.tv_sec >= VM_OOM_WAIT)
+	{
+		dying = false;
+	}
+	if (!dying && victim != NULL)
+	{
+		victim->as_oomkill = true;
+		oom_marked = now;
+	}
+	spinlock_release(&cm_lock);
+
+	if (dying)
+	{
+		return true;
+	}
+	if (victim == NULL)
+	{
+		return false;
+	}
+
+	kprintf("vm: out of memory, killing the largest process\n");
+	if (victim == as)
+	{
+		return false;
+	}
+	proc_wakekilled();
+	return true;
+}
+
+/*
+* Get a zeroed page for a fault of as
+* An address space at its RLIMIT_RSS gives up one of its own pages
+* instead, and the fault fails if it has none that can go to swap.
+* When memory and swap have run out the largest process is killed to
+* make room.
+* Speculative allocations (fault-around) only take a pre-zeroed page
+* and never evict, go past the limit or kill.
+* Returns 0 if no page could be had.
+*/
+static paddr_t vm_fault_alloc(struct addrspace *as, bool speculative)
+{
+	rlim_t limit = curproc->p_rlimits[RLIMIT_RSS].rlim_cur / PAGE_SIZE;
+	paddr_t paddr;
+	int index;
+
+	if (as->as_rss >= limit)
+	{
+		if (speculative)
+		{
+			return 0;
+		}
+		index = coremap_evict(as);
+		if (index == -1)
+		{
+			return 0;
+		}
+		bzero((void *)PADDR_TO_KVADDR(index * PAGE_SIZE), PAGE_SIZE);
+		return index * PAGE_SIZE;
+	}
+
+	if (speculative)
+	{
+		index = zeropool_get();
+		if (index == -1)
+		{
+			return 0;
+		}
+		vmstats_inc(VMSTAT_ZERO_HIT);
+		return index * PAGE_SIZE;
+	}
+
+	/* Ends once every other process with pages has been picked */
+	paddr = alloc_upage();
+	while (paddr == 0 && vm_oom_kill(as))
+	{
+		/* Let the victim run into its death */
+		thread_yield();
+		paddr = alloc_upage();
+	}
+	return paddr;
+}
+
+/*
+* Make the page at vaddr resident and accessible
+* Reads of untouched pages map the zero page, writes to them get a zero
+* filled page, unless part of the page comes from the executable, which
+* is read in. Whole pages of read only segments are shared with other
+* processes through the page cache. Swapped out pages are read back in
+* and writes to pages shared copy-on-write (the zero page included) get
+* their own copy.
+* Called with cm_lock held, which is dropped while allocating and reading
+* from swap; the entry is checked again afterwards in case it changed.
+* With speculative set, pages are allocated as by vm_fault_alloc.
+*/
+static int vm_page_in(struct addrspace *as, struct region *region, vaddr_t vaddr, paddr_t *pte, bool write, bool speculative)
+{
+	struct cm_entry *e;
+	paddr_t oldpte, paddr;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	while (true)
+	{
+		pte_wait(pte);
+		oldpte = *pte;
+
+		if (oldpte & PTE_PRESENT)
+		{
+			e = pte_entry(oldpte);
+			if (e->refcount == 1)
+			{
+				/* Nobody else maps the page, so it is ours to write and evict */
+				e->as = as;
+				e->vaddr = vaddr;
+				if (region->writeable)
+				{
+					*pte |= TLBLO_DIRTY;
+				}
+				break;
+			}
+			if (!write || (oldpte & TLBLO_DIRTY))
+			{
+				break;
+			}
+		}
+		else if (oldpte == 0 && vm_cached_page(region, vaddr))
+		{
+			/* The page cache sleeps, so it is called without the lock */
+			spinlock_release(&cm_lock);
+			result = pagecache_getpage(region->vn, region->vn_offset + (vaddr - region->vn_start), false, &paddr);
+			spinlock_acquire(&cm_lock);
+
+			if (result)
+			{
+				return result;
+			}
+
+			if (*pte != oldpte)
+			{
+				coremap_release(paddr / PAGE_SIZE, NULL);
+				continue;
+			}
+
+			/* Read only: the region can't be written */
+			*pte = paddr | PTE_PRESENT;
+			as->as_rss++;
+			break;
+		}
+		else if (oldpte == 0 && !write && !vm_file_page(region, vaddr))
+		{
+			/* Share the zero page until the first write */
+			cm.cm_entries[zero_page / PAGE_SIZE].refcount++;
+			*pte = zero_page | PTE_PRESENT;
+			vmstats_inc(VMSTAT_ZERO_MAP);
+			break;
+		}
+
+		/* Allocating may evict, so it is done without the lock */
+		spinlock_release(&cm_lock);
+
+		paddr = vm_fault_alloc(as, speculative);
+		if (paddr != 0 && (oldpte & PTE_SWAPPED))
+		{
+			result = swap_in(paddr, PTE_SWAPSLOT(oldpte));
+			if (result)
+			{
+				free_upage(paddr);
+				spinlock_acquire(&cm_lock);
+				return result;
+			}
+			vmstats_inc(VMSTAT_SWAPIN);
+		}
+		else if (paddr != 0 && oldpte == 0 && vm_file_page(region, vaddr))
+		{
+			result = vm_read_file(region, vaddr, paddr);
+			if (result)
+			{
+				free_upage(paddr);
+				spinlock_acquire(&cm_lock);
+				return result;
+			}
+			vmstats_inc(VMSTAT_FILEIN);
+		}
+
+		spinlock_acquire(&cm_lock);
+
+		if (paddr == 0)
+		{
+			return ENOMEM;
+		}
+
+		if (*pte != oldpte)
+		{
+			coremap_release(paddr / PAGE_SIZE, NULL);
+			continue;
+		}
+
+		if (oldpte & PTE_PRESENT)
+		{
+			/* Write to a page shared copy-on-write, drop our reference to it */
+			if ((oldpte & PAGE_FRAME) != zero_page)
+			{
+				memmove((void *)PADDR_TO_KVADDR(paddr), (const void *)PADDR_TO_KVADDR(oldpte & PAGE_FRAME), PAGE_SIZE);
+			}
+			coremap_release((oldpte & PAGE_FRAME) / PAGE_SIZE, as);
+
+			/* Other CPUs may still map the old page */
+			as_invalidate(as);
+			vmstats_inc(VMSTAT_COW);
+		}
+		else if (oldpte & PTE_SWAPPED)
+		{
+			swap_free(PTE_SWAPSLOT(oldpte));
+		}
+
+		e = &cm.cm_entries[paddr / PAGE_SIZE];
+		e->as = as;
+		e->vaddr = vaddr;
+
+		if (!pte_resident(oldpte))
+		{
+			as->as_rss++;
+		}
+		*pte = paddr | PTE_PRESENT;
+		if (region->writeable)
+		{
+			*pte |= TLBLO_DIRTY;
+		}
+		break;
+	}
+
+	/* Mark page as referenced for the clock */
+	*pte |= TLBLO_VALID;
+	return 0;
+}
+
+/*
+* Make the page at vaddr of a file mapped with mmap resident and accessible
+* The page comes from the file's page cache and is shared with every other
+* mapping of the file. It is mapped read only until it is written so the
+* page cache knows to write it back.
+* Called with cm_lock held like vm_page_in.
+*/
+static int vm_page_in_file(struct addrspace *as, struct region *region, vaddr_t vaddr, paddr_t *pte, bool write)
+{
+	paddr_t oldpte, paddr;
+	off_t offset;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	offset = region->vn_offset + (vaddr - region->vbase);
+
+	while (true)
+	{
+		oldpte = *pte;
+		if ((oldpte & PTE_PRESENT) && (!write || (oldpte & TLBLO_DIRTY)))
+		{
+			break;
+		}
+
+		/* The page cache sleeps, so it is called without the lock */
+		spinlock_release(&cm_lock);
+		result = pagecache_getpage(region->vn, offset, write, &paddr);
+		spinlock_acquire(&cm_lock);
+
+		if (result)
+		{
+			return result;
+		}
+
+		if (*pte != oldpte)
+		{
+			coremap_release(paddr / PAGE_SIZE, NULL);
+			continue;
+		}
+
+		if (oldpte & PTE_PRESENT)
+		{
+			/* Already mapped, the page cache just needed to see the write */
+			KASSERT((oldpte & PAGE_FRAME) == paddr);
+			coremap_release(paddr / PAGE_SIZE, NULL);
+		}
+		else
+		{
+			as->as_rss++;
+		}
+
+		*pte = paddr | PTE_PRESENT;
+		if (write)
+		{
+			*pte |= TLBLO_DIRTY;
+		}
+		break;
+	}
+
+	/* Mark page as referenced for the clock */
+	*pte |= TLBLO_VALID;
+	return 0;
+}
+
+/*
+* Load translation for vaddr into the TLB
+* Replaces the existing entry for vaddr if there is one (e.g. after a
+* write to a read only entry), otherwise uses a free slot. If the TLB is
+* full a random entry is replaced; the page stays mapped in the page
+* table, so the victim just faults back in when it is used.
+*/
+static void tlb_load(vaddr_t vaddr, paddr_t pte)
+{
+	uint32_t ehi, elo;
+	int i, spl;
+
+	ehi = vaddr;
+	elo = (pte & PAGE_FRAME) | (pte & TLBLO_DIRTY) | TLBLO_VALID;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0)
+	{
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return;
+	}
+
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		uint32_t oldehi, oldelo;
+
+		tlb_read(&oldehi, &oldelo, i);
+		if (oldelo & TLBLO_VALID)
 		{
 			continue;
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
 		tlb_write(ehi, elo, i);
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
 		splx(spl);
-		return 0;
+		return;
 	}
 
+	tlb_random(ehi, elo);
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+
 	splx(spl);
-	return EFAULT;
-}
\ No newline at end of file
+}
+
+unsigned vm_get_faultaround(void)
+{
+	return faultaround_pages;
+}
+
+int vm_set_faultaround(unsigned npages)
+{
+	if (npages == 0 || npages > FAULTAROUND_MAX || (npages & (npages - 1)) != 0)
+	{
+		return EINVAL;
+	}
+	faultaround_pages = npages;
+	return 0;
+}
+
+/*
+* Map the other pages of the aligned window of faultaround_pages around
+* a fault, so sequential accesses take one fault per window
+* Only pages that are cheap to map are done: resident pages get their
+* translation loaded, and untouched anonymous pages map the zero page on
+* a read or take a pre-zeroed page on a write. Nothing is read from swap
+* or files, nothing is evicted and RLIMIT_RSS is not exceeded.
+* Called with cm_lock held, after the page at faultaddress was mapped.
+*/
+static void vm_fault_around(struct addrspace *as, struct region *region, vaddr_t faultaddress, bool write)
+{
+	rlim_t limit = curproc->p_rlimits[RLIMIT_RSS].rlim_cur / PAGE_SIZE;
+	vaddr_t start, end, vaddr;
+	paddr_t *pte;
+	unsigned npages = faultaround_pages;
+
+	KASSERT(spinlock_do_i_hold(&cm_lock));
+
+	if (npages <= 1)
+	{
+		return;
+	}
+
+	start = faultaddress & ~(vaddr_t)(npages * PAGE_SIZE - 1);
+	end = start + npages * PAGE_SIZE;
+	if (start < region->vbase)
+	{
+		start = region->vbase;
+	}
+	if (end > region->vbase + region->npages * PAGE_SIZE)
+	{
+		end = region->vbase + region->npages * PAGE_SIZE;
+	}
+
+	for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
+	{
+		if (vaddr == faultaddress)
+		{
+			continue;
+		}
+
+		/* The window is in the same page table as the fault */
+		pte = pte_lookup(as->pd, vaddr, false);
+		if (pte == NULL)
+		{
+			continue;
+		}
+
+		if (*pte & PTE_PRESENT)
+		{
+			if (pte_entry(*pte)->is_busy)
+			{
+				continue;
+			}
+			*pte |= TLBLO_VALID;
+		}
+		else
+		{
+			if (*pte != 0 || vm_file_page(region, vaddr))
+			{
+				continue;
+			}
+			if (write && (zeropool_count == 0 || as->as_rss >= limit))
+			{
+				return;
+			}
+			if (vm_page_in(as, region, vaddr, pte, write, true))
+			{
+				return;
+			}
+		}
+
+		tlb_load(vaddr, *pte);
+		vmstats_inc(VMSTAT_FAULTAROUND);
+	}
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *region;
+	paddr_t *pte;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	switch (faulttype)
+	{
+	case VM_FAULT_READONLY:
+	case VM_FAULT_READ:
+	case VM_FAULT_WRITE:
+		break;
+	default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL)
+	{
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL)
+	{
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	/*
+	*  If fault address is not within any valid region
+	*  return EFAULT to indicate invalid memory
+	*/
+	region = as_region_lookup(as, faultaddress);
+	if (region == NULL)
+	{
+		return EFAULT;
+	}
+
+	/* Writes are only allowed on writeable regions */
+	if (faulttype != VM_FAULT_READ && !region->writeable)
+	{
+		return EFAULT;
+	}
+
+	pte = pte_lookup(as->pd, faultaddress, true);
+	if (pte == NULL)
+	{
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&cm_lock);
+
+	if (region->vn != NULL && !region->vn_private)
+	{
+		result = vm_page_in_file(as, region, faultaddress, pte, faulttype != VM_FAULT_READ);
+	}
+	else
+	{
+		result = vm_page_in(as, region, faultaddress, pte, faulttype != VM_FAULT_READ, false);
+	}
+	if (result == 0)
+	{
+		/* make sure it's page-aligned */
+		KASSERT((*pte & PAGE_FRAME) != 0);
+
+		/* Load while holding the lock so eviction can't miss this TLB entry */
+		tlb_load(faultaddress, *pte);
+		vmstats_inc(VMSTAT_TLB_FAULT);
+
+		if (region->vn == NULL || region->vn_private)
+		{
+			vm_fault_around(as, region, faultaddress, faulttype != VM_FAULT_READ);
+		}
+	}
+
+	spinlock_release(&cm_lock);
+
+	return result;
+}
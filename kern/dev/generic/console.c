@@ -53,6 +53,7 @@
 #include <uio.h>
 #include <cpu.h>
 #include <thread.h>
+#include <proc.h>
 #include <current.h>
 #include <synch.h>
 #include <generic/console.h>
@@ -135,6 +136,10 @@ putch_intr(struct con_softc *cs, int ch)
 
 /*
  * Read a character, using interrupts to wait for I/O completion.
+ *
+ * getch_wakeall can V cs_rsem with no character behind it, so there
+ * may be more counts than characters; the extras are just skipped.
+ * Returns -1 if the current process was picked to be killed.
  */
 static
 int
@@ -142,7 +147,15 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
+	while (1) {
+		if (proc_killed()) {
+			return -1;
+		}
+		P(cs->cs_rsem);
+		if (cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+			break;
+		}
+	}
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
@@ -215,6 +228,19 @@ putch(int ch)
 	}
 }
 
+/*
+ * Wake a thread waiting in getch, to check whether it was killed.
+ */
+void
+getch_wakeall(void)
+{
+	struct con_softc *cs = the_console;
+
+	if (cs != NULL) {
+		V(cs->cs_rsem);
+	}
+}
+
 int
 getch(void)
 {
@@ -245,6 +271,7 @@ int
 con_io(struct device *dev, struct uio *uio)
 {
 	int result;
+	int r;
 	char ch;
 	struct lock *lk;
 
@@ -262,7 +289,12 @@ con_io(struct device *dev, struct uio *uio)
 
 	while (uio->uio_resid > 0) {
 		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
+			r = getch();
+			if (r < 0) {
+				lock_release(lk);
+				return EINTR;
+			}
+			ch = r;
 			if (ch=='\r') {
 				ch = '\n';
 			}
@@ -169,6 +169,14 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	/* We're using a global static buffer; it had better be locked */
 	KASSERT(vfs_biglock_do_i_hold());
 
+	/*
+	 * The big lock is recursive, so it doesn't keep a page fault in
+	 * uiomove from coming back here (through an mmap'd file) and
+	 * reusing the buffer. The syscalls copy through kernel buffers
+	 * so that can't happen; make sure it stays that way.
+	 */
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <array.h>
 #include "opt-vm.h"
 
 struct vnode;
@@ -48,6 +49,34 @@ struct vnode;
  * You write this.
  */
 
+/*
+ * Page table entries of resident pages hold the physical page number,
+ * PTE_PRESENT and the TLBLO_VALID and TLBLO_DIRTY bits to load into the
+ * TLB. A resident entry without TLBLO_DIRTY in a writeable region is
+ * copy-on-write. Pages that were only ever read map the shared zero page
+ * this way. TLBLO_VALID doubles as the reference bit for the clock
+ * in vm.c: it is cleared to give the page a second chance and set again
+ * by vm_fault when the page is used.
+ *
+ * Entries of pages that were evicted hold the swap slot number in place
+ * of the physical page number and PTE_SWAPPED. A zero entry has never
+ * been touched.
+ */
+#define PD_INDEX(vaddr) (((vaddr) >> 22) & 0x3FF) // 1st level index (10 msb)
+#define PT_INDEX(vaddr) (((vaddr) >> 12) & 0x3FF) // 2nd level index (10 mid bits)
+
+#define PTE_PRESENT 0x00000001 // Page is in memory
+#define PTE_SWAPPED 0x00000002 // Page is on swap
+#define PTE_SWAPSLOT(pte) ((unsigned)(pte) >> 12) // Swap slot of a swapped entry
+#define PTE_MKSWAP(slot) (((paddr_t)(slot) << 12) | PTE_SWAPPED) // Swapped entry for slot
+
+/* mmap places files below here, leaving room for the stack */
+#define USERMMAPTOP (USERSTACK - 0x01000000)
+
+/* User stack size: default RLIMIT_STACK and the most it can be raised to */
+#define USERSTACK_DEFAULT (1024 * 1024)
+#define USERSTACK_MAX     (USERSTACK - USERMMAPTOP)
+
 struct pagetable {
     paddr_t entries[PAGE_TABLE_ENTRIES]; // Array of page table entries
 };
@@ -63,9 +92,25 @@ struct region {
     int writeable; // Writeable
     int og_writeable; // Original writeable
     int executable; // Executable
-    struct region *next; // Next region
+    struct vnode *vn; // File mapped (NULL if anonymous memory)
+    off_t vn_offset; // File offset of vn_start
+    int vn_private; // Pages are private copies of the file (ELF segments)
+    vaddr_t vn_start; // First address backed by the file
+    size_t vn_filesz; // Bytes backed by the file, the rest is zero filled
+    int vn_cached; // Whole pages of a private read only region come from
+                   // the file's page cache, shared with other processes
 };
 
+/*
+ * Array of regions, kept sorted by vbase so vm_fault can binary search it.
+ */
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region, ASINLINE);
+DEFARRAY(region, ASINLINE);
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -77,8 +122,15 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        struct region *regions;
+        struct regionarray regions; // Sorted by vbase, never overlapping
+        struct region *last_region; // Region found by the last lookup
         struct pagedirectory *pd;
+        unsigned as_id; // TLB entries of this id may be reused (see as_activate)
+        struct region *heap; // Heap region, moved by sbrk (NULL until loaded)
+        vaddr_t heap_end; // Current end of the heap (the break)
+        unsigned as_rss; // Resident pages mapped, protected by cm_lock
+        unsigned as_nswap; // Own pages evicted to swap, protected by cm_lock
+        bool as_oomkill; // Picked to free memory, dies on return to user
 #endif
 };
 
@@ -109,6 +161,12 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_segment - set up a region like as_define_region whose
+ *                first FILESZ bytes are read from VN at OFFSET when
+ *                they are first touched. Pages of read only segments
+ *                are shared with every process running VN when they
+ *                can be; otherwise each page is a private copy.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -118,6 +176,25 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                The stack is as big as the RLIMIT_STACK of curproc.
+ *
+ *    as_region_lookup - find the region containing VADDR, or NULL if
+ *                the address is not part of any region. Tries the
+ *                region of the last lookup before searching.
+ *
+ *    as_invalidate - discard TLB entries of the current address space
+ *                on every CPU after page table permissions were
+ *                reduced.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes and hand back
+ *                the old end. Frees pages the heap shrinks away from.
+ *                The heap can't grow past the RLIMIT_DATA of curproc.
+ *
+ *    as_define_mmap - map LENGTH bytes of file VN from OFFSET at an
+ *                address of the kernel's choosing, handed back in RET.
+ *
+ *    as_munmap - remove the file mapping at VADDR. LENGTH must cover
+ *                the whole mapping. Dirty pages are written back.
  *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
@@ -134,9 +211,23 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_segment(struct addrspace *as,
+                                    vaddr_t vaddr, size_t memsz,
+                                    struct vnode *vn, off_t offset,
+                                    size_t filesz,
+                                    int readable,
+                                    int writeable,
+                                    int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+struct region    *as_region_lookup(struct addrspace *as, vaddr_t vaddr);
+void              as_invalidate(struct addrspace *as);
+int               as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldend);
+int               as_define_mmap(struct addrspace *as, size_t length,
+                                 int writeable, struct vnode *vn,
+                                 off_t offset, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t length);
 
 
 /*
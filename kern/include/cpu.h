@@ -33,7 +33,8 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
-#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX, CPU_PAGECACHE_SIZE */
+#include <vmstats.h>     /* for VMSTAT_COUNT */
 
 
 /*
@@ -61,6 +62,11 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_npagecache;		/* Number of pages in c_pagecache */
+	int c_pagecache[CPU_PAGECACHE_SIZE]; /* Free pages for vm.c */
+	unsigned c_asid;		/* Address space id the TLB holds */
+	struct kmalloc_cpu *c_kmalloc;	/* kmalloc magazines (kmalloc.c) */
+	unsigned c_vmstats[VMSTAT_COUNT]; /* VM events (summed by vmstats.c) */
 
 	/*
 	 * Accessed by other cpus.
@@ -104,8 +110,13 @@ struct cpu {
  * entry point for new CPUs; it can be found in start.S. It calls
  * cpu_hatch after having claimed the startup stack and thread created
  * for the cpu.
+ *
+ * cpu_count and cpu_get give the number of cpus and the cpu with a
+ * given software number, for code that needs to look at all of them.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned software_number);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
@@ -152,7 +163,11 @@ void cpu_halt(void);
  *
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
- * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown is like ipi_send but carries NUM mappings of TLB
+ * shootdown data. If they don't fit in the target's c_shootdown, the
+ * target flushes its whole TLB instead.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current
+ * one and returns how many were sent.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -163,10 +178,14 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_PAGECACHE		4	/* Free page cache should be emptied */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mappings,
+		      unsigned num);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mappings,
+				    unsigned num);
 
 void interprocessor_interrupt(void);
 
@@ -125,13 +125,33 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_indexpages is called by the VM system once the coremap is
+ * up, so kfree can look pages up in it.
+ *
+ * kheap_profile turns the allocation-site profiler on or off, and
+ * kheap_profdump prints its live memory per kmalloc call site.
+ *
+ * kmalloc_site is kmalloc for functions that allocate for their
+ * callers (kstrdup, arrays, object caches). They pass KMALLOC_CALLER()
+ * so the memory is charged to whoever called them.
  */
 void *kmalloc(size_t size);
+void *kmalloc_site(size_t size, const void *caller);
 void kfree(void *ptr);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_indexpages(void);
+void kheap_profile(bool on);
+void kheap_profdump(void);
+
+#ifdef __GNUC__
+#define KMALLOC_CALLER() __builtin_return_address(0)
+#else
+#error "Don't know how to get return address with this compiler"
+#endif
 
 /*
  * C string functions.
@@ -163,6 +183,7 @@ const char *strerror(int errcode);
  */
 void putch(int ch);
 int getch(void);
+void getch_wakeall(void);
 void beep(void);
 
 /*
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for memory-mapped files.
+ *
+ * Each vnode that is mapped with mmap, or run as a program with read
+ * only segments, has a page cache holding the pages of the file that
+ * have been faulted in. All mappings of the
+ * file share those pages, across processes. The cache holds its own
+ * reference on each page, so the pages stay resident while the file is
+ * mapped; they are written back and released when the last mapping
+ * goes away.
+ *
+ * Writes through a mapping are not tracked once the page is writeable,
+ * so a page that was ever written stays dirty until the cache lets go
+ * of it and pagecache_sync writes it out every time.
+ *
+ * Functions:
+ *     pagecache_attach  - count a new mapping of VN, creating its cache
+ *                         if needed.
+ *     pagecache_detach  - drop a mapping of VN. The last one writes back
+ *                         and frees the pages. All page table entries
+ *                         for the mapping must be gone already.
+ *     pagecache_getpage - get the page at file offset OFFSET, reading it
+ *                         in if needed. The page comes with a reference
+ *                         for the caller's page table entry. WRITE marks
+ *                         it dirty.
+ *     pagecache_sync    - write dirty pages back to the file.
+ *     pagecache_destroy - free the cache when VN is reclaimed.
+ */
+
+struct vnode;
+
+int pagecache_attach(struct vnode *vn);
+void pagecache_detach(struct vnode *vn);
+int pagecache_getpage(struct vnode *vn, off_t offset, bool write,
+		      paddr_t *ret);
+int pagecache_sync(struct vnode *vn);
+void pagecache_destroy(struct vnode *vn);
+
+
+#endif /* _PAGECACHE_H_ */
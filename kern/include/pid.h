@@ -70,5 +70,11 @@ void pid_setexitstatus(int status);
  */
 int pid_wait(pid_t targetpid, int *status, int flags, pid_t *retpid);
 
+/*
+ * Wake every thread in pid_wait, so one whose process was killed
+ * returns EINTR (see proc_killed).
+ */
+void pid_wakeall(void);
+
 
 #endif /* _PID_H_ */
\ No newline at end of file
@@ -38,9 +38,13 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
+#include <vmstats.h> /* for VMSTAT_COUNT */
+#include <kern/time.h> /* required for struct rusage */
+#include <kern/resource.h> /* for struct rlimit */
 
 struct addrspace;
 struct vnode;
+struct semaphore;
 
 /*
  * Process structure.
@@ -53,6 +57,9 @@ struct proc {
 	
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	unsigned p_vmstats[VMSTAT_COUNT]; /* VM events (see vmstats.h) */
+	struct rlimit p_rlimits[__RLIMIT_NUM]; /* resource limits */
+	struct semaphore *p_vforksem;	/* parent sleeping in vfork, if any */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -70,8 +77,16 @@ void proc_bootstrap(void);
 /* Create a fresh process for use by runprogram(). */
 int proc_create_runprogram(const char *name, struct proc **ret);
 
-/* Create a fresh process for use by fork() */
-int proc_fork(struct proc **ret);
+/*
+ * Create a fresh process for use by fork(). For vfork(), VFORKSEM is
+ * non-NULL: the new process borrows the current address space instead
+ * of copying it, and VFORKSEM is V'd once it gives it back on execv
+ * or exit.
+ */
+int proc_fork(struct proc **ret, struct semaphore *vforksem);
+
+/* Give back an address space borrowed by vfork(). */
+void proc_vforkdone(struct proc *proc);
  
 /* Undo proc_fork if nothing's run in the new process yet. */
 void proc_unfork(struct proc *proc);
@@ -100,5 +115,15 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/*
+ * Whether the current process was picked to be killed for memory. It
+ * dies on its way back to user mode; interruptible sleeps (waitpid,
+ * console reads) check this and return EINTR to get it there.
+ */
+bool proc_killed(void);
+
+/* Wake all interruptible sleeps so a newly picked process notices. */
+void proc_wakekilled(void);
+
 
 #endif /* _PROC_H_ */
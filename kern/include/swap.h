@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from the coremap go to swap slots. A bitmap tracks
+ * which slots are in use. Slot numbers are stored in the page table
+ * entry of a swapped out page (see PTE_SWAPPED in addrspace.h).
+ *
+ * A slot's page is kept in a pool of kernel memory, compressed with
+ * a small LZ77 compressor, and goes to a block of a raw disk device
+ * only if the pool is full or the page doesn't compress to SWAP_ZMAX
+ * bytes. There are slots for every block of the device plus
+ * SWAP_ZRATIO per page the pool may grow to, so the pool adds to the
+ * swap space, and works without a device.
+ *
+ * The pool starts out empty. It grows by keeping pages that are
+ * being swapped out once their contents are compressed, up to
+ * 1/SWAP_ZPOOL_FRACTION of RAM, and doesn't shrink.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap device, if any, and set up the
+ *                      slots. With neither a device nor room for a
+ *                      pool, swap_alloc always fails.
+ *     swap_alloc     - reserve a free slot.
+ *     swap_free      - release a slot.
+ *     swap_in        - read a slot into a physical page.
+ *     swap_out       - write a physical page to a slot. Sets *pooled
+ *                      if the pool kept the page itself, which the
+ *                      caller must then forget about.
+ *     swap_dup       - copy the contents of a slot into a new slot.
+ *     swap_printstats - print the compressed pool usage.
+ *
+ * swap_in, swap_out and swap_dup sleep and must not be called with
+ * spinlocks held.
+ */
+
+/* Raw disk device used for swap */
+#define SWAP_DEVICE "lhd0raw:"
+
+/* The compressed pool takes up to 1/SWAP_ZPOOL_FRACTION of RAM */
+#define SWAP_ZPOOL_FRACTION 8
+
+/* Pages each page of the pool is counted on to hold, for sizing slots */
+#define SWAP_ZRATIO 4
+
+/* Compressed pages are stored in chains of chunks of this size */
+#define SWAP_ZCHUNK 128
+
+/* Pages that compress worse than this go to disk */
+#define SWAP_ZMAX (PAGE_SIZE * 3 / 4)
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_in(paddr_t paddr, unsigned slot);
+int swap_out(paddr_t paddr, unsigned slot, bool *pooled);
+int swap_dup(unsigned slot, unsigned *newslot);
+void swap_printstats(void);
+
+
+#endif /* _SWAP_H_ */
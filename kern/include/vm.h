@@ -42,6 +42,7 @@
 
 #define DUMBVM_STACKPAGES    18
 #define PAGE_TABLE_ENTRIES   1024
+#define BUDDY_ORDERS         16   /* Free blocks of 1 to 2^15 pages */
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -60,7 +61,10 @@ void free_kpages(vaddr_t addr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
-void vm_tlbshootdown(const struct tlbshootdown *);
+void vm_tlbshootdown(const struct tlbshootdown *, int num);
+
+/* Empty this CPU's free page cache, called from interprocessor_interrupt */
+void vm_pagecache_drain(void);
 
 /* Temporary just to have something compile */
 paddr_t getppages(unsigned long npages);
@@ -68,17 +72,62 @@ paddr_t getppages(unsigned long npages);
 /* Initialize coremap */
 void coremap_init(void);
 
-/* Find free space in coremap */
-int find_free_space(int npages);
+/* Allocate/free a single zeroed physical page for a user address space */
+paddr_t alloc_upage(void);
+void free_upage(paddr_t paddr);
+
+/* Add a reference to a physical page (for pages shared by a page cache) */
+void coremap_incref(paddr_t paddr);
+
+/* Record which kmalloc pageref manages a kernel page (see kmalloc.c) */
+void coremap_setkheap(vaddr_t page, void *kheap);
+void *coremap_getkheap(vaddr_t page);
+
+/* Zero a page for the pre-zeroed pool; false if there was nothing to do */
+bool vm_idle_zero(void);
+
+/* Get/set the number of pages mapped by each fault (1 turns it off) */
+unsigned vm_get_faultaround(void);
+int vm_set_faultaround(unsigned npages);
+
+/*
+ * Page table entry operations for addrspace.c. These synchronize with
+ * eviction, so page table entries holding resident or swapped pages
+ * must not be changed directly.
+ *
+ *    pte_free         - release the page or swap slot held by an entry
+ *                       of address space AS and clear it.
+ *    pte_copy         - make NEWPTE, an entry of NEWAS, a copy of OLDPTE
+ *                       for fork. Resident pages are shared
+ *                       copy-on-write, swapped pages get a copy of
+ *                       their swap slot.
+ *    pte_writeprotect - revoke write permission on a resident page.
+ */
+struct addrspace;
+void pte_free(struct addrspace *as, paddr_t *pte);
+int pte_copy(paddr_t *oldpte, struct addrspace *newas, paddr_t *newpte);
+void pte_writeprotect(paddr_t *pte);
+
+/* Invalidate every entry in this CPU's TLB */
+void vm_tlbflush(void);
 
 struct cm_entry {
     bool is_free; // Flag to indicate if page is free
     bool is_end_malloc; // Flag to indicate if page is the last page of a malloc
+    bool is_busy; // Page is being written to swap
+    unsigned refcount; // Number of page table entries mapping this page
+    struct addrspace *as; // Address space that may evict the page (NULL if none)
+    vaddr_t vaddr; // Virtual address of the page in as
+    int order; // Order of the free block starting here (-1 if none)
+    int next_free; // Next free block of the same order (-1 if none)
+    int prev_free; // Previous free block of the same order (-1 if none)
+    void *kheap; // kmalloc pageref of a subpage heap page (NULL if none)
 };
 
 /*Structure to keep track of used pages in physical memory*/
 struct coremap{
     struct cm_entry *cm_entries;
+    int free_heads[BUDDY_ORDERS]; // First free block of each order (-1 if none)
 };
 
 
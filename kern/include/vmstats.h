@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _VMSTATS_H_
+#define _VMSTATS_H_
+
+/*
+ * VM event counters.
+ *
+ * Every event is counted globally and, outside interrupt handlers and
+ * kernel threads, for the current process too. Faults
+ * taken by the TLB refill fast path in exception-mips1.S never reach C
+ * and are not counted.
+ *
+ *     vmstats_inc   - count one event. May be called with spinlocks
+ *                     held and in interrupt handlers.
+ *     vmstats_proc  - copy the counters of PROC, which must be the
+ *                     current process, into COUNTS.
+ *     vmstats_reset - zero the global counters.
+ *     vmstats_print - print the global counters.
+ */
+
+struct proc;
+
+#define VMSTAT_TLB_FAULT          0  /* Faults handled by vm_fault */
+#define VMSTAT_TLB_FAULT_FREE     1  /* ...into a free TLB slot */
+#define VMSTAT_TLB_FAULT_REPLACE  2  /* ...replacing a valid TLB entry */
+#define VMSTAT_TLB_FLUSH          3  /* as_activate flushed the TLB */
+#define VMSTAT_TLB_RETAIN         4  /* as_activate kept the TLB */
+#define VMSTAT_ZERO_HIT           5  /* User page taken pre-zeroed */
+#define VMSTAT_ZERO_MISS          6  /* User page zeroed on demand */
+#define VMSTAT_ZERO_MAP           7  /* Read fault mapped the zero page */
+#define VMSTAT_FAULTAROUND        8  /* Extra pages mapped by fault-around */
+#define VMSTAT_COW                9  /* Copy-on-write faults given a copy */
+#define VMSTAT_SWAPIN            10  /* Pages read back from swap */
+#define VMSTAT_FILEIN            11  /* Pages read from files */
+#define VMSTAT_EVICT             12  /* Pages evicted to swap */
+#define VMSTAT_SHOOTDOWN         13  /* TLB shootdowns started */
+#define VMSTAT_SHOOTDOWN_IPI     14  /* ...IPIs sent for them */
+#define VMSTAT_SHOOTDOWN_ALL     15  /* IPIs that flushed the whole TLB */
+#define VMSTAT_SWAP_ZSTORE       16  /* Swapped pages kept compressed */
+#define VMSTAT_SWAP_DISK         17  /* Swapped pages written to disk */
+#define VMSTAT_COUNT             18
+
+void vmstats_inc(unsigned index);
+void vmstats_proc(struct proc *proc, unsigned *counts);
+void vmstats_reset(void);
+void vmstats_print(void);
+
+
+#endif /* _VMSTATS_H_ */
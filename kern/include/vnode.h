@@ -32,6 +32,7 @@
 
 #include <spinlock.h>
 struct uio;
+struct pagecache;
 struct stat;
 
 
@@ -57,6 +58,8 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	struct pagecache *vn_pagecache; /* Pages mapped by mmap, if any */
 };
 
 /*
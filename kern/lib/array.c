@@ -39,7 +39,7 @@ array_create(void)
 {
 	struct array *a;
 
-	a = kmalloc(sizeof(*a));
+	a = kmalloc_site(sizeof(*a), KMALLOC_CALLER());
 	if (a != NULL) {
 		array_init(a);
 	}
@@ -75,8 +75,12 @@ array_cleanup(struct array *a)
 #endif
 }
 
+/*
+ * Make room for NUM elements; the memory is charged to CALLER.
+ */
+static
 int
-array_preallocate(struct array *a, unsigned num)
+array_grow(struct array *a, unsigned num, const void *caller)
 {
 	void **newptr;
 	unsigned newmax;
@@ -95,7 +99,7 @@ array_preallocate(struct array *a, unsigned num)
 		 * about this and/or kmalloc makes it not worthwhile?)
 		 */
 
-		newptr = kmalloc(newmax*sizeof(*a->v));
+		newptr = kmalloc_site(newmax*sizeof(*a->v), caller);
 		if (newptr == NULL) {
 			return ENOMEM;
 		}
@@ -107,12 +111,18 @@ array_preallocate(struct array *a, unsigned num)
 	return 0;
 }
 
+int
+array_preallocate(struct array *a, unsigned num)
+{
+	return array_grow(a, num, KMALLOC_CALLER());
+}
+
 int
 array_setsize(struct array *a, unsigned num)
 {
 	int result;
 
-	result = array_preallocate(a, num);
+	result = array_grow(a, num, KMALLOC_CALLER());
 	if (result) {
 		return result;
 	}
@@ -39,7 +39,7 @@ kstrdup(const char *s)
 {
 	char *z;
 
-	z = kmalloc(strlen(s)+1);
+	z = kmalloc_site(strlen(s)+1, KMALLOC_CALLER());
 	if (z == NULL) {
 		return NULL;
         }
@@ -43,10 +43,12 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <vmstats.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
 #include <pid.h>
+#include <openfile.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -114,6 +116,7 @@ boot(void)
 	pid_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	openfile_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -160,6 +163,8 @@ shutdown(void)
 
 	thread_shutdown();
 
+	vmstats_print();
+
 	splhigh();
 }
 
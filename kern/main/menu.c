@@ -43,6 +43,10 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <vmstats.h>
+#include <swap.h>
+#include <kmem_cache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 
@@ -244,6 +248,46 @@ cmd_sync(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for printing (or zeroing) the VM statistics.
+ */
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vmstats_print();
+		swap_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vmstats_reset();
+	}
+	else {
+		kprintf("Usage: vm [reset]\n");
+	}
+
+	return 0;
+}
+
+/*
+ * Command for showing or setting the VM fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Fault-around: %u pages\n", vm_get_faultaround());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: fa [pages]\n");
+		return EINVAL;
+	}
+
+	return vm_set_faultaround(atoi(args[1]));
+}
+
 /*
  * Command for doing an intentional panic.
  */
@@ -376,6 +420,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 
 	return 0;
 }
@@ -409,6 +454,35 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		kheap_profile(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		kheap_profile(false);
+	}
+	else {
+		kprintf("Usage: khprof on|off\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_kheapprofdump(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_profdump();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -448,6 +522,8 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[fa]      VM fault-around pages     ",
+	"[vm]      VM statistics             ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -511,6 +587,8 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profiler on/off",
+	"[khprofdump] Kernel heap profile    ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -551,6 +629,7 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "fa",		cmd_faultaround },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -560,6 +639,9 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+	{ "khprofdump", cmd_kheapprofdump },
+	{ "vm",		cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
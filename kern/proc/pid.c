@@ -43,6 +43,7 @@
 #include <current.h>
 #include <synch.h>
 #include <pid.h>
+#include <kmem_cache.h>
 
 /*
  * Structure for holding exit data of a thread.
@@ -72,6 +73,29 @@ static struct lock *pidlock;		// lock for global exit data
 static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
+static struct kmem_cache *pidinfo_cache; // pidinfos with their cv
+
+static
+int
+pidinfo_ctor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	pi->pi_cv = cv_create("pidinfo cv");
+	if (pi->pi_cv == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+pidinfo_dtor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_destroy(pi->pi_cv);
+}
 
 
 
@@ -86,17 +110,11 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	KASSERT(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = kmem_cache_alloc(pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
-		kfree(pi);
-		return NULL;
-	}
-
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
@@ -114,8 +132,7 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	kmem_cache_free(pidinfo_cache, pi);
 }
 
 ////////////////////////////////////////////////////////////
@@ -133,6 +150,12 @@ pid_bootstrap(void)
 		panic("Out of memory creating pid lock\n");
 	}
 
+	pidinfo_cache = kmem_cache_create("pidinfo", sizeof(struct pidinfo),
+					  pidinfo_ctor, pidinfo_dtor);
+	if (pidinfo_cache == NULL) {
+		panic("Out of memory creating pidinfo cache\n");
+	}
+
 	/* not really necessary - should start zeroed */
 	for (i=0; i<PROCS_MAX; i++) {
 		pidinfo[i] = NULL;
@@ -438,9 +461,14 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 			*ret = 0;
 			return 0;
 		}
-		/* don't need to loop on this */
-		cv_wait(them->pi_cv, pidlock);
-		KASSERT(them->pi_exited == true);
+		/* pid_wakeall may wake us early */
+		while (them->pi_exited == false) {
+			if (proc_killed()) {
+				lock_release(pidlock);
+				return EINTR;
+			}
+			cv_wait(them->pi_cv, pidlock);
+		}
 	}
 
 	if (status != NULL) {
@@ -462,4 +490,26 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 
 	lock_release(pidlock);
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * pid_wakeall - wake up everyone in pid_wait. Skipped if the caller
+ * already holds pidlock, since it can't be waiting then.
+ */
+void
+pid_wakeall(void)
+{
+	int i;
+
+	if (lock_do_i_hold(pidlock)) {
+		return;
+	}
+
+	lock_acquire(pidlock);
+	for (i=0; i<PROCS_MAX; i++) {
+		if (pidinfo[i] != NULL) {
+			cv_broadcast(pidinfo[i]->pi_cv, pidlock);
+		}
+	}
+	lock_release(pidlock);
+}
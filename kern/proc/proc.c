@@ -45,18 +45,44 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <spl.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <pid.h>
 #include <filetable.h>
+#include <kmem_cache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/* Proc structures, kept with their lock and thread array set up. */
+static struct kmem_cache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -66,22 +92,29 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 	proc->p_pid = INVALID_PID;
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	bzero(proc->p_vmstats, sizeof(proc->p_vmstats));
+	for (unsigned i = 0; i < __RLIMIT_NUM; i++) {
+		proc->p_rlimits[i].rlim_cur = RLIM_INFINITY;
+		proc->p_rlimits[i].rlim_max = RLIM_INFINITY;
+	}
+	proc->p_rlimits[RLIMIT_STACK].rlim_cur = USERSTACK_DEFAULT;
+	proc->p_rlimits[RLIMIT_STACK].rlim_max = USERSTACK_MAX;
+	proc->p_vforksem = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -127,6 +160,20 @@ proc_destroy(struct proc *proc)
 	}
 
 	/* VM fields */
+	if (proc->p_vforksem != NULL) {
+		/*
+		 * The address space belongs to the parent, which is
+		 * waiting in vfork. Hand it back instead of destroying it.
+		 */
+		if (proc == curproc) {
+			proc_setas(NULL);
+			as_deactivate();
+		}
+		else {
+			proc->p_addrspace = NULL;
+		}
+		proc_vforkdone(proc);
+	}
 	if (proc->p_addrspace) {
 		/*
 		 * If p is the current process, remove it safely from
@@ -175,11 +222,10 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -188,6 +234,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -254,7 +306,7 @@ proc_create_runprogram(const char *name, struct proc **ret)
  * (the caller decides that).
  */
 int
-proc_fork(struct proc **ret)
+proc_fork(struct proc **ret, struct semaphore *vforksem)
 {
 	struct proc *newproc;
 	struct addrspace *as;
@@ -283,8 +335,14 @@ proc_fork(struct proc **ret)
 #endif
 
 	/* VM fields */
+	memcpy(newproc->p_rlimits, curproc->p_rlimits,
+	       sizeof(newproc->p_rlimits));
 	as = proc_getas();
-	if (as != NULL) {
+	if (as != NULL && vforksem != NULL) {
+		newproc->p_addrspace = as;
+		newproc->p_vforksem = vforksem;
+	}
+	else if (as != NULL) {
 		result = as_copy(as, &newproc->p_addrspace);
 		if (result) {
 			pid_unalloc(newproc->p_pid);
@@ -299,8 +357,10 @@ proc_fork(struct proc **ret)
 	if (tbl != NULL) {
 		result = filetable_copy(tbl, &newproc->p_filetable);
 		if (result) {
-			as_destroy(newproc->p_addrspace);
-			newproc->p_addrspace = NULL;
+			if (newproc->p_vforksem == NULL) {
+				as_destroy(newproc->p_addrspace);
+				newproc->p_addrspace = NULL;
+			}
 			pid_unalloc(newproc->p_pid);
 			newproc->p_pid = INVALID_PID;
 			proc_destroy(newproc);
@@ -324,6 +384,20 @@ proc_fork(struct proc **ret)
 	return 0;
 }
 
+/*
+ * Wake up the parent waiting in vfork. The caller has already let go
+ * of the borrowed address space.
+ */
+void
+proc_vforkdone(struct proc *proc)
+{
+	KASSERT(proc->p_vforksem != NULL);
+	KASSERT(proc->p_addrspace == NULL || proc == curproc);
+
+	V(proc->p_vforksem);
+	proc->p_vforksem = NULL;
+}
+
  /*
   * Undo proc_fork if nothing's run in the new process yet.
   */
@@ -453,6 +527,30 @@ proc_getas(void)
 	return as;
 }
 
+/*
+ * The mark is set under cm_lock in vm.c; a stale read only delays the
+ * kill until the next return to user mode.
+ */
+bool
+proc_killed(void)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	return as != NULL && as->as_oomkill;
+}
+
+/*
+ * The sleepers that weren't picked find nothing to do and go back
+ * to sleep.
+ */
+void
+proc_wakekilled(void)
+{
+	pid_wakeall();
+	getch_wakeall();
+}
+
 /*
  * Change the address space of (the current) process. Return the old
  * one for later restoration or disposal.
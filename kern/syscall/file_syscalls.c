@@ -104,10 +104,23 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 	return 0;
 }
 
+/*
+ * User buffers are never handed to the file system. Touching one can
+ * fault, and the fault may need the file system itself (a page of an
+ * mmap'd file or of a demand-loaded executable), which SFS can't take
+ * in the middle of another I/O: sfs_partialio has a single block
+ * buffer. So data goes through a kernel buffer of up to BOUNCE_SIZE
+ * bytes at a time, and all copying to and from the user happens
+ * outside VOP_READ and VOP_WRITE.
+ */
+#define BOUNCE_SIZE 4096
+
 /*
  * Common logic for read and write.
  *
- * Look up the fd, then use VOP_READ or VOP_WRITE.
+ * Look up the fd, then use VOP_READ or VOP_WRITE, a chunk at a time.
+ * If a chunk fails after some data was moved, what was moved is
+ * reported.
  */
 static
 int
@@ -118,7 +131,9 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	bool locked;
 	off_t pos;
 	struct iovec iov;
-	struct uio useruio;
+	struct uio kuio;
+	char *kbuf;
+	size_t done, len, moved;
 	int result;
 
 	/* better be a valid file descriptor */
@@ -142,30 +157,74 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		goto fail;
 	}
 
-	/* set up a uio with the buffer, its size, and the current offset */
-	uio_uinit(&iov, &useruio, buf, size, pos, rw);
+	kbuf = NULL;
+	if (size > 0) {
+		kbuf = kmalloc(size < BOUNCE_SIZE ? size : BOUNCE_SIZE);
+		if (kbuf == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+	}
+
+	done = 0;
+	result = 0;
+	while (done < size) {
+		len = size - done;
+		if (len > BOUNCE_SIZE) {
+			len = BOUNCE_SIZE;
+		}
 
-	/* do the read or write */
-	result = (rw == UIO_READ) ?
-		VOP_READ(file->of_vnode, &useruio) :
-		VOP_WRITE(file->of_vnode, &useruio);
-	if (result) {
+		if (rw == UIO_WRITE) {
+			result = copyin((const_userptr_t)(buf + done),
+					kbuf, len);
+			if (result) {
+				break;
+			}
+		}
+
+		/* set up a uio with the chunk and the current offset */
+		uio_kinit(&iov, &kuio, kbuf, len, pos, rw);
+
+		/* do the read or write */
+		result = (rw == UIO_READ) ?
+			VOP_READ(file->of_vnode, &kuio) :
+			VOP_WRITE(file->of_vnode, &kuio);
+		if (result) {
+			break;
+		}
+
+		moved = len - kuio.uio_resid;
+		if (rw == UIO_READ && moved > 0) {
+			result = copyout(kbuf, buf + done, moved);
+			if (result) {
+				break;
+			}
+		}
+
+		done += moved;
+		pos = kuio.uio_offset;
+
+		/* a short transfer (end of file, a console line) ends it */
+		if (moved < len) {
+			break;
+		}
+	}
+	kfree(kbuf);
+
+	if (result && done == 0) {
 		goto fail;
 	}
 
 	if (locked) {
 		/* set the offset to the updated offset in the uio */
-		file->of_offset = useruio.uio_offset;
+		file->of_offset = pos;
 		lock_release(file->of_offsetlock);
 	}
 
 	filetable_put(curproc->p_filetable, fd, file);
 
-	/*
-	 * The amount read (or written) is the original buffer size,
-	 * minus how much is left in it.
-	 */
-	*retval = size - useruio.uio_resid;
+	/* The amount read (or written) is what made it through. */
+	*retval = done;
 
 	return 0;
 
@@ -360,22 +419,38 @@ sys_chdir(const_userptr_t path)
 
 /*
  * __getcwd() - get current directory. Make a uio and get the data
- * from the VFS code.
+ * from the VFS code, into a kernel buffer like read (see above).
  */
 int
 sys___getcwd(userptr_t buf, size_t buflen, int *retval)
 {
 	struct iovec iov;
-	struct uio useruio;
+	struct uio kuio;
+	char *kbuf;
+	size_t len;
 	int result;
 
-	uio_uinit(&iov, &useruio, buf, buflen, 0, UIO_READ);
+	len = buflen < PATH_MAX ? buflen : PATH_MAX;
+	kbuf = kmalloc(len + 1);
+	if (kbuf == NULL) {
+		return ENOMEM;
+	}
+
+	uio_kinit(&iov, &kuio, kbuf, len, 0, UIO_READ);
+
+	result = vfs_getcwd(&kuio);
+	if (result) {
+		kfree(kbuf);
+		return result;
+	}
 
-	result = vfs_getcwd(&useruio);
+	len -= kuio.uio_resid;
+	result = copyout(kbuf, buf, len);
+	kfree(kbuf);
 	if (result) {
 		return result;
 	}
 
-	*retval = buflen - useruio.uio_resid;
+	*retval = len;
 	return 0;
 }
@@ -40,6 +40,7 @@
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <synch.h>
 #include <copyinout.h>
 #include <pid.h>
 #include <syscall.h>
@@ -119,7 +120,7 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	}
 	*ntf = *tf;
 
-	result = proc_fork(&newproc);
+	result = proc_fork(&newproc, NULL);
 	if (result) {
 		kfree(ntf);
 		return result;
@@ -137,6 +138,58 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_vfork
+ *
+ * like fork, but the new process runs in our address space (skipping
+ * as_copy) and we sleep until it calls execv or exits. The file table
+ * is still copied, so the child can rearrange its descriptors.
+ */
+int
+sys_vfork(struct trapframe *tf, pid_t *retval)
+{
+	struct trapframe *ntf;
+	struct semaphore *sem;
+	int result;
+	struct proc *newproc;
+
+	ntf = kmalloc(sizeof(struct trapframe));
+	if (ntf==NULL) {
+		return ENOMEM;
+	}
+	*ntf = *tf;
+
+	sem = sem_create("vfork", 0);
+	if (sem == NULL) {
+		kfree(ntf);
+		return ENOMEM;
+	}
+
+	result = proc_fork(&newproc, sem);
+	if (result) {
+		sem_destroy(sem);
+		kfree(ntf);
+		return result;
+	}
+	*retval = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc,
+			     fork_newthread, ntf, 0);
+	if (result) {
+		/* this V's sem, but nobody needs to wait for it */
+		proc_unfork(newproc);
+		sem_destroy(sem);
+		kfree(ntf);
+		return result;
+	}
+
+	/* newproc is gone or running something else once this returns */
+	P(sem);
+	sem_destroy(sem);
+
+	return 0;
+}
+
 /*
  * sys_waitpid
  * just pass off the work to the pid code.
@@ -390,8 +390,14 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	 *
 	 * Note: once this is done, execv() must not fail, because there's
 	 * nothing left for it to return an error to.
+	 *
+	 * After vfork the old address space is the parent's; give it
+	 * back instead.
 	 */
-	if (oldvm) {
+	if (curproc->p_vforksem != NULL) {
+		proc_vforkdone(curproc);
+	}
+	else if (oldvm) {
 		as_destroy(oldvm);
 	}
 
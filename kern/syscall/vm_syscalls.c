@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memory-related syscalls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <pagecache.h>
+#include <vmstats.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+
+/*
+ * sys_sbrk
+ *
+ * Move the end of the heap. The new pages are zero-filled on first
+ * touch by vm_fault. Returns the old end.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	vaddr_t oldend;
+	int result;
+
+	result = as_sbrk(proc_getas(), amount, &oldend);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)oldend;
+	return 0;
+}
+
+/*
+ * sys_mmap
+ *
+ * Map part of an open file, shared with every other mapping of the
+ * file. Writing requires the file to be open for both reading and
+ * writing, since pages are read in before they are written.
+ *
+ * The TLB can't make a page writable or executable but not readable,
+ * so mappings must include PROT_READ, which also rules out PROT_NONE.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int *retval)
+{
+	struct openfile *file;
+	vaddr_t addr;
+	int result;
+
+	if (length == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0 ||
+	    (prot & PROT_READ) == 0) {
+		return EINVAL;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	/* Let the filesystem say whether this can be mapped */
+	result = VOP_MMAP(file->of_vnode);
+	if (result == 0) {
+		result = as_define_mmap(proc_getas(), length,
+					(prot & PROT_WRITE) != 0,
+					file->of_vnode, offset, &addr);
+	}
+
+	filetable_put(curproc->p_filetable, fd, file);
+
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)addr;
+	return 0;
+}
+
+/*
+ * sys_munmap
+ */
+int
+sys_munmap(userptr_t addr, size_t length)
+{
+	if ((vaddr_t)addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	return as_munmap(proc_getas(), (vaddr_t)addr, length);
+}
+
+/*
+ * sys_fsync
+ *
+ * Write back pages dirtied through mappings of the file first, then
+ * ask the filesystem to do its part.
+ */
+int
+sys_fsync(int fd)
+{
+	struct openfile *file;
+	int result;
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	result = pagecache_sync(file->of_vnode);
+	if (result == 0) {
+		result = VOP_FSYNC(file->of_vnode);
+	}
+
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * sys_getrusage
+ *
+ * Only the VM counters of the calling process are kept: faults that
+ * read a page from swap or a file are major faults, the rest minor.
+ * Swaps are the process's own pages that went to swap, whoever evicted
+ * them, so they are counted in the address space rather than by
+ * vmstats_inc; the count is read without cm_lock, as a snapshot.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	unsigned counts[VMSTAT_COUNT];
+	struct rusage ru;
+	unsigned major;
+
+	if (who != RUSAGE_SELF) {
+		return EINVAL;
+	}
+
+	vmstats_proc(curproc, counts);
+	major = counts[VMSTAT_SWAPIN] + counts[VMSTAT_FILEIN];
+
+	bzero(&ru, sizeof(ru));
+	ru.ru_majflt = major;
+	if (counts[VMSTAT_TLB_FAULT] > major) {
+		ru.ru_minflt = counts[VMSTAT_TLB_FAULT] - major;
+	}
+	ru.ru_nswap = proc_getas()->as_nswap;
+
+	return copyout(&ru, usage, sizeof(ru));
+}
+
+/*
+ * Only the memory limits are kept.
+ */
+static
+bool
+rlimit_supported(int resource)
+{
+	return resource == RLIMIT_DATA || resource == RLIMIT_STACK ||
+		resource == RLIMIT_RSS;
+}
+
+/*
+ * sys_getrlimit
+ */
+int
+sys_getrlimit(int resource, userptr_t rlp)
+{
+	struct rlimit rl;
+
+	if (!rlimit_supported(resource)) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	rl = curproc->p_rlimits[resource];
+	spinlock_release(&curproc->p_lock);
+
+	return copyout(&rl, rlp, sizeof(rl));
+}
+
+/*
+ * sys_setrlimit
+ *
+ * There are no privileged users, so hard limits can only be lowered.
+ * RLIMIT_STACK takes effect at the next exec.
+ */
+int
+sys_setrlimit(int resource, const_userptr_t rlp)
+{
+	struct rlimit rl;
+	int result;
+
+	if (!rlimit_supported(resource)) {
+		return EINVAL;
+	}
+
+	result = copyin(rlp, &rl, sizeof(rl));
+	if (result) {
+		return result;
+	}
+	if (rl.rlim_cur > rl.rlim_max) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	if (rl.rlim_max > curproc->p_rlimits[resource].rlim_max) {
+		spinlock_release(&curproc->p_lock);
+		return EPERM;
+	}
+	curproc->p_rlimits[resource] = rl;
+	spinlock_release(&curproc->p_lock);
+
+	return 0;
+}
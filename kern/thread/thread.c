@@ -53,6 +53,7 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
+#include <kmem_cache.h>
 
 #include "opt-synchprobs.h"
 
@@ -81,6 +82,9 @@ static struct wchanarray allwchans;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Thread structures, which keep their stacks while cached. */
+static struct kmem_cache *thread_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -120,26 +124,68 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor and destructor for thread_cache: the stack.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = kmalloc(STACK_SIZE);
+	if (thread->t_stack == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	kfree(thread->t_stack);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * Threads come from thread_cache with a stack, except the boot
+ * thread of the boot cpu (BOOTSTACK set), which runs on the boot
+ * stack, has none of its own, and never gets destroyed.
  */
 static
 struct thread *
-thread_create(const char *name)
+thread_create(const char *name, bool bootstack)
 {
 	struct thread *thread;
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	if (bootstack) {
+		thread = kmalloc(sizeof(*thread));
+		if (thread != NULL) {
+			thread->t_stack = NULL;
+		}
+	}
+	else {
+		thread = kmem_cache_alloc(thread_cache);
+	}
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		if (bootstack) {
+			kfree(thread);
+		}
+		else {
+			kmem_cache_free(thread_cache, thread);
+		}
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -148,7 +194,9 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	if (thread->t_stack != NULL) {
+		thread_checkstack_init(thread);
+	}
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -190,6 +238,10 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_npagecache = 0;
+	c->c_asid = 0;
+	c->c_kmalloc = NULL;
+	bzero(c->c_vmstats, sizeof(c->c_vmstats));
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -205,7 +257,12 @@ cpu_create(unsigned hardware_number)
 	}
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
-	c->c_curthread = thread_create(namebuf);
+	/*
+	 * The boot cpu's first thread is the one running now, on the
+	 * boot stack, which can't be freed. (Exercise: what would it
+	 * take to make it possible to free the boot stack?)
+	 */
+	c->c_curthread = thread_create(namebuf, c->c_number == 0);
 	if (c->c_curthread == NULL) {
 		panic("cpu_create: thread_create failed\n");
 	}
@@ -214,22 +271,6 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: proc_addthread:: %s\n", strerror(result));
 	}
 
-	if (c->c_number == 0) {
-		/*
-		 * Leave c->c_curthread->t_stack NULL for the boot
-		 * cpu. This means we're using the boot stack, which
-		 * can't be freed. (Exercise: what would it take to
-		 * make it possible to free the boot stack?)
-		 */
-		/*c->c_curthread->t_stack = ... */
-	}
-	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
-		if (c->c_curthread->t_stack == NULL) {
-			panic("cpu_create: couldn't allocate stack");
-		}
-		thread_checkstack_init(c->c_curthread);
-	}
 	c->c_curthread->t_cpu = c;
 
 	cpu_machdep_init(c);
@@ -259,9 +300,6 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -269,7 +307,10 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+
+	/* The stack goes back to thread_cache with the rest. */
+	KASSERT(thread->t_stack != NULL);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -361,6 +402,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -503,19 +550,12 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* This comes with a stack */
+	newthread = thread_create(name, false);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
-
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
@@ -529,7 +569,6 @@ thread_fork(const char *name,
 	}
 	result = proc_addthread(proc, newthread);
 	if (result) {
-		/* thread_destroy will clean up the stack */
 		thread_destroy(newthread);
 		return result;
 	}
@@ -647,7 +686,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Zero pages for the VM system before really idling */
+			if (!vm_idle_zero()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -1155,6 +1197,18 @@ ipi_send(struct cpu *target, int code)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned software_number)
+{
+	return cpuarray_get(&allcpus, software_number);
+}
+
 void
 ipi_broadcast(int code)
 {
@@ -1170,19 +1224,26 @@ ipi_broadcast(int code)
 }
 
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mappings,
+		 unsigned num)
 {
 	int n;
+	unsigned i;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* nothing to add */
+	}
+	else if (num > (unsigned)(TLBSHOOTDOWN_MAX - n)) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		for (i=0; i<num; i++) {
+			target->c_shootdown[n+i] = mappings[i];
+		}
+		target->c_numshootdown = n+num;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
@@ -1191,11 +1252,27 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mappings, unsigned num)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mappings, num);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
-	int i;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
@@ -1228,13 +1305,17 @@ interprocessor_interrupt(void)
 			vm_tlbshootdown_all();
 		}
 		else {
-			for (i=0; i<curcpu->c_numshootdown; i++) {
-				vm_tlbshootdown(&curcpu->c_shootdown[i]);
-			}
+			vm_tlbshootdown(curcpu->c_shootdown,
+					curcpu->c_numshootdown);
 		}
 		curcpu->c_numshootdown = 0;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	/* Not under c_ipi_lock: it is taken with cm_lock held */
+	if (bits & (1U << IPI_PAGECACHE)) {
+		vm_pagecache_drain();
+	}
 }
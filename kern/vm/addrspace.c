@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -34,7 +36,14 @@
 #include <vm.h>
 #include <proc.h>
 #include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vmstats.h>
+#include <vnode.h>
+#include <pagecache.h>
 #include <mips/tlb.h>
+#include <mips/trapframe.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -42,6 +51,21 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/* Address space ids, never reused so a stale id can't match */
+static unsigned as_nextid = 1;
+static struct spinlock as_id_lock = SPINLOCK_INITIALIZER;
+
+static unsigned
+as_newid(void)
+{
+	unsigned id;
+
+	spinlock_acquire(&as_id_lock);
+	id = as_nextid++;
+	spinlock_release(&as_id_lock);
+
+	return id;
+}
 
 struct addrspace *
 as_create(void)
@@ -51,17 +75,31 @@ as_create(void)
 		return NULL;
 	}
 
-	as->regions = NULL; /* At start no regions in addrespace */
+	regionarray_init(&as->regions); /* At start no regions in addrespace */
+	as->last_region = NULL;
+	as->as_id = as_newid();
+	as->heap = NULL; /* Set up by as_complete_load */
+	as->heap_end = 0;
+	as->as_rss = 0;
+	as->as_nswap = 0;
+	as->as_oomkill = false;
 
 	/* Create page directory */
 	as->pd = kmalloc(sizeof(struct pagedirectory));
 	if(as->pd == NULL) {
+		regionarray_cleanup(&as->regions);
 		kfree(as);
 		return NULL;
 	}
 
 	/* Initialize page directory */
 	as->pd->pagetables = kmalloc(sizeof(struct pagetable *) * PAGE_TABLE_ENTRIES);
+	if(as->pd->pagetables == NULL) {
+		kfree(as->pd);
+		regionarray_cleanup(&as->regions);
+		kfree(as);
+		return NULL;
+	}
 	for(int i = 0; i < PAGE_TABLE_ENTRIES; i++) {
 		as->pd->pagetables[i] = NULL;
 	}
@@ -69,13 +107,31 @@ as_create(void)
 	return as;
 }
 
+/* Free a region, letting go of the file it maps */
+static void
+as_free_region(struct region *region)
+{
+	if(region->vn != NULL) {
+		if(!region->vn_private || region->vn_cached) {
+			pagecache_detach(region->vn);
+		}
+		VOP_DECREF(region->vn);
+	}
+	kfree(region);
+}
+
 void
 as_destroy(struct addrspace *as)
 {
 
-	/* Free page tables */
+	/* Release mapped pages and swap slots and free page tables */
 	for(int i = 0; i < PAGE_TABLE_ENTRIES; i++) {
 		if(as->pd->pagetables[i] != NULL) {
+			for(int j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+				if(as->pd->pagetables[i]->entries[j] != 0) {
+					pte_free(as, &as->pd->pagetables[i]->entries[j]);
+				}
+			}
 			kfree(as->pd->pagetables[i]);
 		}
 	}
@@ -84,52 +140,115 @@ as_destroy(struct addrspace *as)
 	kfree(as->pd->pagetables);
 	kfree(as->pd);
 
-	struct region *region = as->regions;
-	while(region != NULL) {
-		struct region *next = region->next;
-		kfree(region);
-		region = next;
+	for(unsigned i = 0; i < regionarray_num(&as->regions); i++) {
+		as_free_region(regionarray_get(&as->regions, i));
 	}
+	regionarray_setsize(&as->regions, 0);
+	regionarray_cleanup(&as->regions);
 
 	kfree(as);
 }
 
+/*
+*  The TLB is only flushed if this CPU last ran a different address space
+*  (or this one before it was invalidated). Kernel threads have no address
+*  space and leave the TLB alone.
+*  Also points the TLB refill fast path at the page tables.
+*/
 void
 as_activate(void)
 {
-	int i, spl;
+	struct addrspace *as = proc_getas();
+	int spl;
+
+	if(as == NULL) {
+		as_deactivate();
+		return;
+	}
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i); //Check this
+	/* Page tables for the TLB refill fast path */
+	cpupagetables[curcpu->c_number] = (vaddr_t)as->pd->pagetables;
+
+	if(curcpu->c_asid != as->as_id) {
+		vm_tlbflush();
+		curcpu->c_asid = as->as_id;
+		vmstats_inc(VMSTAT_TLB_FLUSH);
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_RETAIN);
 	}
 
 	splx(spl);
 }
 
+/*
+*  Stop the TLB refill fast path from using the page tables. The TLB can
+*  stay: ids are never reused, so whatever is activated next flushes it.
+*/
 void
 as_deactivate(void)
 {
-	int i, spl;
+	int spl;
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
+	cpupagetables[curcpu->c_number] = 0;
+	splx(spl);
+}
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i); //Check this
-	}
+/*
+*  Drop TLB entries for the current address space after permissions were
+*  taken away. This CPU's TLB is flushed; other CPUs that ran the address
+*  space before see its new id and flush when they activate it again.
+*/
+void
+as_invalidate(struct addrspace *as)
+{
+	int spl;
+
+	KASSERT(as == proc_getas());
+
+	spl = splhigh();
+
+	as->as_id = as_newid();
+	vm_tlbflush();
+	curcpu->c_asid = as->as_id;
 
 	splx(spl);
 }
 
-/* Define a region in the address space 
-*  The new region will be the head of the linked list of regions of this addrespace
+/*
+*  Number of regions starting at or below vaddr
+*  The region containing vaddr, if any, is the one before that.
 */
-int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 int readable, int writeable, int executable)
+static unsigned
+as_region_slot(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo = 0;
+	unsigned hi = regionarray_num(&as->regions);
+
+	while(lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if(regionarray_get(&as->regions, mid)->vbase <= vaddr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+*  Define a region in the address space and hand it back in ret
+*  The region is put in its place in the sorted region array
+*/
+static int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	      int readable, int writeable, int executable,
+	      struct region **ret)
 {
 	size_t npages;
 
@@ -153,9 +272,69 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	region->writeable = writeable;
 	region->og_writeable = writeable;
 	region->executable = executable;
-	region->next = as->regions;
+	region->vn = NULL;
+	region->vn_offset = 0;
+	region->vn_private = 0;
+	region->vn_start = vaddr;
+	region->vn_filesz = 0;
+	region->vn_cached = 0;
+
+	unsigned num = regionarray_num(&as->regions);
+	unsigned slot = as_region_slot(as, vaddr);
+	int result = regionarray_setsize(&as->regions, num + 1);
+	if(result) {
+		kfree(region);
+		return result;
+	}
+	for(unsigned i = num; i > slot; i--) {
+		regionarray_set(&as->regions, i, regionarray_get(&as->regions, i - 1));
+	}
+	regionarray_set(&as->regions, slot, region);
+
+	if(ret != NULL) {
+		*ret = region;
+	}
+	return 0;
+}
+
+/* Define a region in the address space */
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	return as_add_region(as, vaddr, sz, readable, writeable, executable, NULL);
+}
+
+/*
+*  Define a region backed by part of an executable
+*  Nothing is read here: vm_fault reads each page from the file the first
+*  time it is touched. Read only segments laid out page by page like the
+*  file share their pages through the page cache; if the cache can't be
+*  set up they get private pages instead.
+*/
+int
+as_define_segment(struct addrspace *as, vaddr_t vaddr, size_t memsz,
+		  struct vnode *vn, off_t offset, size_t filesz,
+		  int readable, int writeable, int executable)
+{
+	struct region *region;
+	int result;
+
+	result = as_add_region(as, vaddr, memsz, readable, writeable, executable, &region);
+	if(result) {
+		return result;
+	}
+
+	VOP_INCREF(vn);
+	region->vn = vn;
+	region->vn_offset = offset;
+	region->vn_private = 1;
+	region->vn_start = vaddr;
+	region->vn_filesz = filesz;
 
-	as->regions = region;
+	if(!writeable && (vaddr - offset) % PAGE_SIZE == 0) {
+		region->vn_cached = pagecache_attach(vn) == 0;
+	}
 
 	return 0;
 }
@@ -164,36 +343,73 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 int
 as_prepare_load(struct addrspace *as)
 {
-	struct region *region = as->regions;
-	while(region != NULL) {
+	for(unsigned i = 0; i < regionarray_num(&as->regions); i++) {
+		struct region *region = regionarray_get(&as->regions, i);
 		if(region->writeable == 0) {
 			region->writeable = 1;
 		}
-		region = region->next;
 	}
 	return 0;
 }
 
-/* Restore read only regions state */
+/* 
+*  Restore read only regions state 
+*  Pages loaded into them were mapped writeable, so revoke that too
+*/
 int
 as_complete_load(struct addrspace *as)
 {
-	struct region *region = as->regions;
-	while(region != NULL) {
+	struct region *region;
+	for(unsigned r = 0; r < regionarray_num(&as->regions); r++) {
+		region = regionarray_get(&as->regions, r);
 		if(region->og_writeable == 0) {
 			region->writeable = 0;
+			for(size_t i = 0; i < region->npages; i++) {
+				vaddr_t vaddr = region->vbase + i * PAGE_SIZE;
+				struct pagetable *pt = as->pd->pagetables[PD_INDEX(vaddr)];
+				if(pt != NULL && (pt->entries[PT_INDEX(vaddr)] & PTE_PRESENT)) {
+					pte_writeprotect(&pt->entries[PT_INDEX(vaddr)]);
+				}
+			}
 		}
-		region = region->next;
 	}
+
+	as_invalidate(as);
+
+	/* The heap starts out empty on the page after the highest segment */
+	vaddr_t heap_start = 0;
+	unsigned num = regionarray_num(&as->regions);
+	if(num > 0) {
+		region = regionarray_get(&as->regions, num - 1);
+		heap_start = region->vbase + region->npages * PAGE_SIZE;
+	}
+
+	int result = as_add_region(as, heap_start, 0, 1, 1, 0, &as->heap);
+	if(result) {
+		return result;
+	}
+	as->heap_end = heap_start;
+
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+	rlim_t size = curproc->p_rlimits[RLIMIT_STACK].rlim_cur;
+
+	/* Pages are only used once touched, so the whole limit is mapped */
+	if(size > USERSTACK_MAX) {
+		size = USERSTACK_MAX;
+	}
+	size = (size + PAGE_SIZE - 1) & PAGE_FRAME;
+	if(size == 0) {
+		size = PAGE_SIZE;
+	}
+
 	*stackptr = USERSTACK;
 
-	int result = as_define_region(as, USERSTACK - STACK_SIZE, STACK_SIZE, 1, 1, 1);
+	int result = as_define_region(as, USERSTACK - size, size, 1, 1, 1);
     if (result) {
         return result;
     }
@@ -202,6 +418,215 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
     return 0;
 }
 
+/*
+*  Release the pages in [vaddr, vaddr + npages * PAGE_SIZE)
+*  Page tables left empty are freed too
+*/
+static void
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	if(npages == 0) {
+		return;
+	}
+
+	for(size_t i = 0; i < npages; i++) {
+		vaddr_t va = vaddr + i * PAGE_SIZE;
+		struct pagetable *pt = as->pd->pagetables[PD_INDEX(va)];
+		if(pt != NULL && pt->entries[PT_INDEX(va)] != 0) {
+			pte_free(as, &pt->entries[PT_INDEX(va)]);
+		}
+	}
+
+	for(unsigned i = PD_INDEX(vaddr); i <= PD_INDEX(vaddr + npages * PAGE_SIZE - 1); i++) {
+		struct pagetable *pt = as->pd->pagetables[i];
+		if(pt == NULL) {
+			continue;
+		}
+
+		int j;
+		for(j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+			if(pt->entries[j] != 0) {
+				break;
+			}
+		}
+		if(j == PAGE_TABLE_ENTRIES) {
+			as->pd->pagetables[i] = NULL;
+			kfree(pt);
+		}
+	}
+
+	as_invalidate(as);
+}
+
+/*
+*  Move the end of the heap for sbrk
+*  The heap region covers the pages up to the new end; it must not run
+*  into any other region.
+*/
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldend)
+{
+	struct region *heap = as->heap;
+	vaddr_t newend;
+	size_t npages;
+
+	if(heap == NULL) {
+		return ENOMEM;
+	}
+
+	if(amount < 0 && (vaddr_t)-amount > as->heap_end - heap->vbase) {
+		return EINVAL;
+	}
+	if(amount > 0 && (vaddr_t)amount > USERSPACETOP - as->heap_end) {
+		return ENOMEM;
+	}
+
+	newend = as->heap_end + amount;
+	if(amount > 0 && newend - heap->vbase > curproc->p_rlimits[RLIMIT_DATA].rlim_cur) {
+		return ENOMEM;
+	}
+	npages = (newend - heap->vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if(npages > heap->npages) {
+		/* Only regions starting inside the new heap can be in the way */
+		vaddr_t top = heap->vbase + npages * PAGE_SIZE;
+		for(unsigned i = as_region_slot(as, heap->vbase - 1); i < regionarray_num(&as->regions); i++) {
+			struct region *region = regionarray_get(&as->regions, i);
+			if(region->vbase >= top) {
+				break;
+			}
+			if(region != heap) {
+				return ENOMEM;
+			}
+		}
+	}
+	else {
+		as_unmap(as, heap->vbase + npages * PAGE_SIZE, heap->npages - npages);
+	}
+
+	*oldend = as->heap_end;
+	heap->npages = npages;
+	as->heap_end = newend;
+	return 0;
+}
+
+/*
+*  Map a file for mmap
+*  The mapping goes in the highest free range below USERMMAPTOP and above
+*  the heap. Its pages are faulted in from the file's page cache.
+*/
+int
+as_define_mmap(struct addrspace *as, size_t length, int writeable,
+	       struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	size_t sz = (length + PAGE_SIZE - 1) & PAGE_FRAME;
+	vaddr_t bottom = (as->heap_end + PAGE_SIZE - 1) & PAGE_FRAME;
+	vaddr_t vaddr;
+	int result;
+
+	if(sz == 0 || sz > USERMMAPTOP - bottom) {
+		return ENOMEM;
+	}
+
+	/* Move down past every region in the way, highest first */
+	vaddr = USERMMAPTOP - sz;
+	for(unsigned i = as_region_slot(as, vaddr + sz - 1); i > 0; i--) {
+		struct region *region = regionarray_get(&as->regions, i - 1);
+		if(region->vbase + region->npages * PAGE_SIZE <= vaddr) {
+			break;
+		}
+		if(region->vbase < bottom + sz) {
+			return ENOMEM;
+		}
+		vaddr = region->vbase - sz;
+	}
+
+	result = pagecache_attach(vn);
+	if(result) {
+		return result;
+	}
+
+	struct region *region;
+	result = as_add_region(as, vaddr, sz, 1, writeable, 0, &region);
+	if(result) {
+		pagecache_detach(vn);
+		return result;
+	}
+
+	VOP_INCREF(vn);
+	region->vn = vn;
+	region->vn_offset = offset;
+	region->vn_filesz = sz;
+
+	*ret = vaddr;
+	return 0;
+}
+
+/*
+*  Remove a file mapping for munmap
+*  Only whole mappings can be removed
+*/
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t length)
+{
+	unsigned slot = as_region_slot(as, vaddr);
+	struct region *region;
+	int result;
+
+	if(slot == 0) {
+		return EINVAL;
+	}
+
+	region = regionarray_get(&as->regions, slot - 1);
+	if(region->vn == NULL || region->vn_private || region->vbase != vaddr || region->npages != (length + PAGE_SIZE - 1) / PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	regionarray_remove(&as->regions, slot - 1);
+	if(as->last_region == region) {
+		as->last_region = NULL;
+	}
+	as_unmap(as, region->vbase, region->npages);
+
+	result = pagecache_sync(region->vn);
+	as_free_region(region);
+
+	return result;
+}
+
+/*
+*  Find the region of the address space containing vaddr
+*  Faults tend to hit the same region over and over, so the last region
+*  found is checked before the binary search.
+*/
+struct region *
+as_region_lookup(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *region = as->last_region;
+
+	if(region != NULL && vaddr >= region->vbase && vaddr < region->vbase + region->npages * PAGE_SIZE) {
+		return region;
+	}
+
+	unsigned slot = as_region_slot(as, vaddr);
+	if(slot == 0) {
+		return NULL;
+	}
+
+	region = regionarray_get(&as->regions, slot - 1);
+	if(vaddr < region->vbase + region->npages * PAGE_SIZE) {
+		as->last_region = region;
+		return region;
+	}
+	return NULL;
+}
+
+/*
+*  Copy an address space for fork
+*  Resident pages are not copied: both address spaces map the same pages
+*  read only and vm_fault gives each side its own copy on the first write.
+*  Swapped out pages get their own swap slot.
+*/
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -213,16 +638,37 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	}
 
 	/* Copy regions by defining new regions on new addresspace*/
-	struct region *region = old->regions;
+	for(unsigned i = 0; i < regionarray_num(&old->regions); i++) {
+		struct region *region = regionarray_get(&old->regions, i);
+		struct region *copy;
 
-	while(region != NULL) {
-		int result = as_define_region(new, region->vbase, region->npages * PAGE_SIZE, region->readable, region->writeable, region->executable);
+		int result = as_add_region(new, region->vbase, region->npages * PAGE_SIZE, region->readable, region->writeable, region->executable, &copy);
 		if(result) {
 			as_destroy(new);
 			return result;
 		}
-		region = region->next;
-	};
+		if(region == old->heap) {
+			new->heap = copy;
+		}
+		if(region->vn != NULL) {
+			if(!region->vn_private || region->vn_cached) {
+				result = pagecache_attach(region->vn);
+				if(result) {
+					as_destroy(new);
+					return result;
+				}
+			}
+			VOP_INCREF(region->vn);
+			copy->vn = region->vn;
+			copy->vn_offset = region->vn_offset;
+			copy->vn_private = region->vn_private;
+			copy->vn_start = region->vn_start;
+			copy->vn_filesz = region->vn_filesz;
+			copy->vn_cached = region->vn_cached;
+		}
+	}
+
+	new->heap_end = old->heap_end;
 
 	/* Copy page directory */
 	for(int i = 0; i < PAGE_TABLE_ENTRIES; i++) {
@@ -233,14 +679,28 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 				return ENOMEM;
 			}
 
+			/* Install first so as_destroy cleans up after a failed copy */
 			for(int j = 0; j < PAGE_TABLE_ENTRIES; j++) {
-				new_pt->entries[j] = old->pd->pagetables[i]->entries[j];
+				new_pt->entries[j] = 0;
 			}
-
 			new->pd->pagetables[i] = new_pt;
+
+			for(int j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+				if(old->pd->pagetables[i]->entries[j] != 0) {
+					int result = pte_copy(&old->pd->pagetables[i]->entries[j], new, &new_pt->entries[j]);
+					if(result) {
+						as_invalidate(old);
+						as_destroy(new);
+						return result;
+					}
+				}
+			}
 		}
 	}
 
+	/* Old address space lost write permission on its pages */
+	as_invalidate(old);
+
 
 	*ret = new;
 	return 0;
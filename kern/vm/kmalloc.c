@@ -30,6 +30,9 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <spl.h>
 #include <vm.h>
 
 /*
@@ -121,15 +124,32 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/*
+ * MAGAZINES puts per-cpu caches of free blocks in front of the
+ * subpage allocator (see below). Blocks in the caches keep neither
+ * guard bands nor labels, so it is off with GUARDS and LABELS.
+ */
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * The sizes past 2048 don't fit twice in a page, so their blocks are
+ * carved out of runs of several pages (slabs) instead; slabpages[]
+ * gives the number of pages per slab for each size.
+ */
+#define NSIZES 11
+static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048,
+				      2560, 3072, 3584 };
+static const unsigned slabpages[NSIZES] = { 1, 1, 1, 1, 1, 1, 1, 1,
+					    5, 3, 7 };
 
 #define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_SUBPAGE_SIZE 3584
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -157,13 +177,15 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+/* Bytes of heap a pageref manages */
+#define SLAB_SIZE(blk)   (slabpages[blk] * PAGE_SIZE)
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole subpage allocator. Most small
+ * allocations are served from per-cpu magazines (see below) without
+ * taking it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -172,61 +194,52 @@ static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 /*
  * We can only allocate whole pages of pageref structure at a time.
- * This is a struct type for such a page.
+ * This is a struct type for such a page. The bitmap of free entries
+ * lives at the front of the page, so a pageref's page can be found
+ * from its address.
+ *
+ * Each pageref page contains 253 pagerefs, which can manage up to
+ * 253 * 4K (a bit under 1M) of kernel heap.
  *
- * Each pageref page contains 256 pagerefs, which can manage up to
- * 256 * 4K = 1M of kernel heap.
+ * Pageref pages are allocated as the heap grows and given back when
+ * all their pagerefs are free, except that the last one is kept.
  */
 
-#define NPAGEREFS_PER_PAGE (PAGE_SIZE / sizeof(struct pageref))
+#define NPAGEREFS_PER_PAGE \
+	((PAGE_SIZE - 2 * sizeof(void *) - 8 * sizeof(uint32_t)) / \
+	 sizeof(struct pageref))
+#define INUSE_WORDS DIVROUNDUP(NPAGEREFS_PER_PAGE, 32)
 
 struct pagerefpage {
-	struct pageref refs[NPAGEREFS_PER_PAGE];
-};
-
-/*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
+	struct pagerefpage *next;
 	unsigned numinuse;
+	uint32_t pagerefs_inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS_PER_PAGE];
 };
 
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
- */
-
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
-
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+static struct pagerefpage *pagerefpages;
+static unsigned npagerefpages;
+#define TOTAL_PAGEREFS (npagerefpages * NPAGEREFS_PER_PAGE)
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a page to hold pagerefs and put it on the list.
  */
 static
 void
-allocpagerefpage(struct kheap_root *root)
+allocpagerefpage(void)
 {
+	struct pagerefpage *page;
 	vaddr_t va;
+	unsigned i;
 
-	KASSERT(root->page == NULL);
+	KASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
+	 * Note that this means things can change behind our back;
+	 * if somebody else added a page meanwhile, we just end up
+	 * with a spare.
 	 */
 	spinlock_release(&kmalloc_spinlock);
 	va = alloc_kpages(1);
@@ -237,17 +250,20 @@ allocpagerefpage(struct kheap_root *root)
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	page = (struct pagerefpage *)va;
+	page->numinuse = 0;
+	for (i=0; i<INUSE_WORDS; i++) {
+		page->pagerefs_inuse[i] = 0;
+	}
+	/* Mark the bits past the end of refs[] as in use. */
+	if (NPAGEREFS_PER_PAGE % 32 != 0) {
+		page->pagerefs_inuse[INUSE_WORDS - 1] =
+			~(uint32_t)0 << (NPAGEREFS_PER_PAGE % 32);
 	}
 
-	root->page = (struct pagerefpage *)va;
+	page->next = pagerefpages;
+	pagerefpages = page;
+	npagerefpages++;
 }
 
 /*
@@ -259,81 +275,80 @@ allocpageref(void)
 {
 	unsigned i,j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	struct pagerefpage *page;
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
+	while (1) {
+		for (page = pagerefpages; page != NULL; page = page->next) {
+			if (page->numinuse >= NPAGEREFS_PER_PAGE) {
 				continue;
 			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
+
+			/*
+			 * This should probably not be a linear search.
+			 */
+			for (i=0; i<INUSE_WORDS; i++) {
+				if (page->pagerefs_inuse[i]==0xffffffff) {
+					/* full */
+					continue;
+				}
+				for (k=1,j=0; k!=0; k<<=1,j++) {
+					if ((page->pagerefs_inuse[i] & k)==0) {
+						page->pagerefs_inuse[i] |= k;
+						page->numinuse++;
+						return &page->refs[i*32 + j];
 					}
-					return &root->page->refs[i*32 + j];
 				}
+				KASSERT(0);
 			}
 			KASSERT(0);
 		}
-	}
 
-	/* ran out */
-	return NULL;
+		/* ran out; get another page and look again */
+		i = npagerefpages;
+		allocpagerefpage();
+		if (npagerefpages == i) {
+			return NULL;
+		}
+	}
 }
 
 /*
- * Release a pageref structure.
+ * Release a pageref structure. If that leaves its page empty, and it
+ * isn't the only one, take the page off the list and return it; the
+ * caller frees it once it lets go of kmalloc_spinlock. Otherwise
+ * return 0.
  */
 static
-void
+vaddr_t
 freepageref(struct pageref *p)
 {
 	size_t i, j;
 	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	struct pagerefpage *page, **prev;
+
+	page = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+
+	j = p-page->refs;
+	/* note: j is unsigned, don't test < 0 */
+	KASSERT(j < NPAGEREFS_PER_PAGE);
+	i = j/32;
+	k = ((uint32_t)1) << (j%32);
+	KASSERT((page->pagerefs_inuse[i] & k) != 0);
+	page->pagerefs_inuse[i] &= ~k;
+	KASSERT(page->numinuse > 0);
+	page->numinuse--;
+
+	if (page->numinuse > 0 || npagerefpages == 1) {
+		return 0;
+	}
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
+	for (prev = &pagerefpages; *prev != page; prev = &(*prev)->next) {
+		/* pageref wasn't on any of the pages */
+		KASSERT(*prev != NULL);
 	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	*prev = page->next;
+	npagerefpages--;
+	return (vaddr_t)page;
 }
 
 ////////////////////////////////////////
@@ -345,6 +360,40 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Once the coremap is up, each heap page's coremap entry points to its
+ * pageref, so kfree doesn't have to search allbase. Pages from before
+ * then are entered by kheap_indexpages.
+ */
+static bool pagerefs_indexed;
+
+/*
+ * Point the coremap entries of all the pages PR manages at KHEAP.
+ */
+static
+void
+setkheap(struct pageref *pr, void *kheap)
+{
+	unsigned i;
+
+	for (i=0; i<slabpages[PR_BLOCKTYPE(pr)]; i++) {
+		coremap_setkheap(PR_PAGEADDR(pr) + i * PAGE_SIZE, kheap);
+	}
+}
+
+void
+kheap_indexpages(void)
+{
+	struct pageref *pr;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		setkheap(pr, pr);
+	}
+	pagerefs_indexed = true;
+	spinlock_release(&kmalloc_spinlock);
+}
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -498,7 +547,7 @@ checksubpage(struct pageref *pr)
 	struct freelist *fl;
 	int blktype;
 	int nfree=0;
-	size_t blocksize;
+	size_t blocksize, slabsize;
 #ifdef CHECKGUARDS
 	const unsigned maxblocks = PAGE_SIZE / SMALLEST_SUBPAGE_SIZE;
 	const unsigned numfreewords = DIVROUNDUP(maxblocks, 32);
@@ -518,6 +567,7 @@ checksubpage(struct pageref *pr)
 	blktype = PR_BLOCKTYPE(pr);
 	KASSERT(blktype >= 0 && blktype < NSIZES);
 	blocksize = sizes[blktype];
+	slabsize = SLAB_SIZE(blktype);
 
 #ifdef CHECKGUARDS
 	smallerblocksize = blktype > 0 ? sizes[blktype - 1] : 0;
@@ -531,7 +581,7 @@ checksubpage(struct pageref *pr)
 	KASSERT(prpage < MIPS_KSEG1);
 #endif
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < slabsize);
 	KASSERT(pr->freelist_offset % blocksize == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -539,7 +589,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + slabsize);
 		KASSERT((fla-prpage) % blocksize == 0);
 #ifdef CHECKBEEF
 		checkdeadbeef(fl, blocksize);
@@ -556,7 +606,7 @@ checksubpage(struct pageref *pr)
 	KASSERT(nfree==pr->nfree);
 
 #ifdef CHECKGUARDS
-	numblocks = PAGE_SIZE / blocksize;
+	numblocks = slabsize / blocksize;
 	for (i=0; i<numblocks; i++) {
 		mask = 1U << (i % 32);
 		if ((isfree[i / 32] & mask) == 0) {
@@ -640,7 +690,7 @@ void
 dump_subpage(struct pageref *pr, unsigned generation)
 {
 	unsigned blocksize = sizes[PR_BLOCKTYPE(pr)];
-	unsigned numblocks = PAGE_SIZE / blocksize;
+	unsigned numblocks = SLAB_SIZE(PR_BLOCKTYPE(pr)) / blocksize;
 	unsigned numfreewords = DIVROUNDUP(numblocks, 32);
 	uint32_t isfree[numfreewords], mask;
 	vaddr_t prpage;
@@ -765,7 +815,7 @@ subpage_stats(struct pageref *pr)
 	KASSERT(blktype >= 0 && blktype < NSIZES);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = SLAB_SIZE(blktype) / sizes[blktype];
 	KASSERT(n <= 32 * ARRAYCOUNT(freemap));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -794,6 +844,10 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+#ifdef MAGAZINES
+static void kmag_printstats(void);
+#endif
+
 /*
  * Print the whole heap.
  */
@@ -805,13 +859,18 @@ kheap_printstats(void)
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
-	kprintf("Subpage allocator status:\n");
+	kprintf("Subpage allocator status: %u pageref pages\n",
+		npagerefpages);
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		subpage_stats(pr);
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	kmag_printstats();
+#endif
 }
 
 ////////////////////////////////////////
@@ -884,6 +943,7 @@ subpage_kmalloc(size_t sz
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
+	size_t slabsize;	// SLAB_SIZE(blktype)
 
 	volatile int i;
 
@@ -904,6 +964,7 @@ subpage_kmalloc(size_t sz
 #endif
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
+	slabsize = SLAB_SIZE(blktype);
 
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -919,7 +980,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			KASSERT(pr->freelist_offset < slabsize);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
@@ -931,7 +992,7 @@ subpage_kmalloc(size_t sz
 			if (fl != NULL) {
 				KASSERT(pr->nfree > 0);
 				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
+				KASSERT(fla - prpage < slabsize);
 				pr->freelist_offset = fla - prpage;
 			}
 			else {
@@ -962,7 +1023,7 @@ subpage_kmalloc(size_t sz
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	prpage = alloc_kpages(slabpages[blktype]);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
@@ -971,7 +1032,7 @@ subpage_kmalloc(size_t sz
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
-	fill_deadbeef((void *)prpage, PAGE_SIZE);
+	fill_deadbeef((void *)prpage, slabsize);
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -985,7 +1046,7 @@ subpage_kmalloc(size_t sz
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = slabsize / sizes[blktype];
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1011,6 +1072,8 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	setkheap(pr, pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
@@ -1030,6 +1093,7 @@ subpage_kfree(void *ptr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t pagerefpage;	// pageref page to free, if any
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1063,17 +1127,16 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+	if (pagerefs_indexed) {
+		pr = coremap_getkheap(ptraddr & PAGE_FRAME);
+	}
+	else {
+		for (pr = allbase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+			if (ptraddr >= prpage &&
+			    ptraddr < prpage + SLAB_SIZE(PR_BLOCKTYPE(pr))) {
+				break;
+			}
 		}
 	}
 
@@ -1083,10 +1146,18 @@ subpage_kfree(void *ptr)
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(ptraddr >= prpage && ptraddr < prpage + SLAB_SIZE(blktype));
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset >= SLAB_SIZE(blktype) || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -1131,14 +1202,18 @@ subpage_kfree(void *ptr)
 	pr->freelist_offset = offset;
 	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+	KASSERT(pr->nfree <= SLAB_SIZE(blktype) / sizes[blktype]);
+	if (pr->nfree == SLAB_SIZE(blktype) / sizes[blktype]) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
-		freepageref(pr);
+		setkheap(pr, NULL);
+		pagerefpage = freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
+		if (pagerefpage != 0) {
+			free_kpages(pagerefpage);
+		}
 	}
 	else {
 		spinlock_release(&kmalloc_spinlock);
@@ -1156,28 +1231,600 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+#ifdef MAGAZINES
+
+////////////////////////////////////////////////////////////
+//
+// Magazines.
+//
+// Each cpu has two magazines (stacks of free blocks) per size class,
+// used only with interrupts off, so most kmalloc/kfree pairs never
+// touch kmalloc_spinlock. When both are empty (kmalloc) or full
+// (kfree) the cpu trades one with the depot, which keeps full and
+// empty magazines for all cpus under kmag_spinlock. Past the depot's
+// limits blocks go back to the subpage allocator as before.
+//
+// The size class of a block being freed comes from the pageref in the
+// coremap entry of its page, so that doesn't need kmalloc_spinlock
+// either.
+//
+
+/* Blocks per magazine (fewer for classes above KMAG_FULLSIZE) */
+#define KMAG_ROUNDS 15
+
+/* Classes up to 2K are cached; past 512 bytes magazines get shorter */
+#define KMAG_MAXSIZE 2048
+#define KMAG_FULLSIZE 512
+
+/* Most full magazines kept in the depot, and magazines made, per class */
+#define KDEPOT_MAXFULL 8
+#define KDEPOT_MAXMAGS 16
+
+struct kmagazine {
+	struct kmagazine *next;
+	unsigned nrounds;
+	void *rounds[KMAG_ROUNDS];
+};
+
+struct kmalloc_cpu {
+	struct kmagazine *loaded[NSIZES];
+	struct kmagazine *previous[NSIZES];
+};
+
+struct kdepot {
+	struct kmagazine *full;
+	struct kmagazine *empty;
+	unsigned nfull;
+	unsigned nmags;
+};
+
+static struct spinlock kmag_spinlock = SPINLOCK_INITIALIZER;
+static struct kdepot kdepots[NSIZES];
+
+/*
+ * Rounds a magazine of class BLKTYPE holds, so that one of the bigger
+ * classes holds no more memory than one of KMAG_FULLSIZE blocks.
+ */
+static
+unsigned
+kmag_rounds(unsigned blktype)
+{
+	if (sizes[blktype] <= KMAG_FULLSIZE) {
+		return KMAG_ROUNDS;
+	}
+	return KMAG_ROUNDS * KMAG_FULLSIZE / sizes[blktype];
+}
+
+/*
+ * Get this cpu's magazines, setting them up the first time. Called
+ * with interrupts off.
+ */
+static
+struct kmalloc_cpu *
+kmag_cpu(void)
+{
+	struct kmalloc_cpu *kc;
+	unsigned i;
+
+	kc = curcpu->c_kmalloc;
+	if (kc == NULL) {
+		kc = subpage_kmalloc(sizeof(struct kmalloc_cpu));
+		if (kc == NULL) {
+			return NULL;
+		}
+		for (i=0; i<NSIZES; i++) {
+			kc->loaded[i] = NULL;
+			kc->previous[i] = NULL;
+		}
+		curcpu->c_kmalloc = kc;
+	}
+	return kc;
+}
+
+/*
+ * Get an empty magazine from the depot, or make a new one if the
+ * class doesn't have too many. Returns NULL if neither works.
+ */
+static
+struct kmagazine *
+kmag_getempty(unsigned blktype)
+{
+	struct kdepot *d = &kdepots[blktype];
+	struct kmagazine *mag;
+
+	spinlock_acquire(&kmag_spinlock);
+	mag = d->empty;
+	if (mag != NULL) {
+		d->empty = mag->next;
+		spinlock_release(&kmag_spinlock);
+		return mag;
+	}
+	if (d->nmags >= KDEPOT_MAXMAGS) {
+		spinlock_release(&kmag_spinlock);
+		return NULL;
+	}
+	d->nmags++;
+	spinlock_release(&kmag_spinlock);
+
+	mag = subpage_kmalloc(sizeof(struct kmagazine));
+	if (mag == NULL) {
+		spinlock_acquire(&kmag_spinlock);
+		d->nmags--;
+		spinlock_release(&kmag_spinlock);
+		return NULL;
+	}
+	mag->nrounds = 0;
+	return mag;
+}
+
+/*
+ * Take a block of size class BLKTYPE from this cpu's magazines.
+ * Returns NULL if there's none to be had without the subpage
+ * allocator.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct kmagazine *mag, *full;
+	struct kdepot *d = &kdepots[blktype];
+	void *ret = NULL;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* too early in boot for per-cpu anything */
+		return NULL;
+	}
+
+	spl = splhigh();
+
+	kc = curcpu->c_kmalloc;
+	if (kc == NULL) {
+		splx(spl);
+		return NULL;
+	}
+
+	mag = kc->loaded[blktype];
+	if (mag == NULL || mag->nrounds == 0) {
+		if (kc->previous[blktype] != NULL &&
+		    kc->previous[blktype]->nrounds > 0) {
+			kc->loaded[blktype] = kc->previous[blktype];
+			kc->previous[blktype] = mag;
+		}
+		else {
+			spinlock_acquire(&kmag_spinlock);
+			full = d->full;
+			if (full != NULL) {
+				d->full = full->next;
+				d->nfull--;
+				if (kc->previous[blktype] != NULL) {
+					kc->previous[blktype]->next = d->empty;
+					d->empty = kc->previous[blktype];
+				}
+				kc->previous[blktype] = mag;
+				kc->loaded[blktype] = full;
+			}
+			spinlock_release(&kmag_spinlock);
+		}
+		mag = kc->loaded[blktype];
+	}
+
+	if (mag != NULL && mag->nrounds > 0) {
+		ret = mag->rounds[--mag->nrounds];
+	}
+
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Put a block of size class BLKTYPE in this cpu's magazines. Returns
+ * -1 if it has to go to the subpage allocator instead.
+ */
+static
+int
+kmag_free(void *ptr, unsigned blktype)
+{
+	struct kmalloc_cpu *kc;
+	struct kmagazine *mag, *prev, *empty;
+	struct kdepot *d = &kdepots[blktype];
+	unsigned rounds = kmag_rounds(blktype);
+	int ret = -1;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return -1;
+	}
+
+	spl = splhigh();
+
+	kc = kmag_cpu();
+	if (kc == NULL) {
+		splx(spl);
+		return -1;
+	}
+
+	mag = kc->loaded[blktype];
+	if (mag == NULL || mag->nrounds == rounds) {
+		prev = kc->previous[blktype];
+		if (prev != NULL && prev->nrounds < rounds) {
+			kc->loaded[blktype] = prev;
+			kc->previous[blktype] = mag;
+		}
+		else if (prev != NULL && d->nfull >= KDEPOT_MAXFULL) {
+			/* Depot is full up; empty prev the slow way */
+			while (prev->nrounds > 0) {
+				subpage_kfree(prev->rounds[--prev->nrounds]);
+			}
+			kc->loaded[blktype] = prev;
+			kc->previous[blktype] = mag;
+		}
+		else {
+			empty = kmag_getempty(blktype);
+			if (empty != NULL) {
+				if (prev != NULL) {
+					spinlock_acquire(&kmag_spinlock);
+					prev->next = d->full;
+					d->full = prev;
+					d->nfull++;
+					spinlock_release(&kmag_spinlock);
+				}
+				kc->previous[blktype] = mag;
+				kc->loaded[blktype] = empty;
+			}
+		}
+		mag = kc->loaded[blktype];
+	}
+
+	if (mag != NULL && mag->nrounds < rounds) {
+		mag->rounds[mag->nrounds++] = ptr;
+		ret = 0;
+	}
+
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Print how many magazines the depot holds.
+ */
+static
+void
+kmag_printstats(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&kmag_spinlock);
+	kprintf("Magazine depot:\n");
+	for (i=0; i<NSIZES; i++) {
+		if (kdepots[i].nmags == 0) {
+			continue;
+		}
+		kprintf("   size %-4lu  %u magazines, %u full in depot\n",
+			(unsigned long) sizes[i], kdepots[i].nmags,
+			kdepots[i].nfull);
+	}
+	spinlock_release(&kmag_spinlock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
+#endif /* MAGAZINES */
+
+////////////////////////////////////////////////////////////
+//
+// Allocation-site profiler.
+//
+// While it is on, every kmalloc is charged to its caller's return
+// address in a table of sites (live bytes, live blocks, and total
+// allocations), and every live block is kept in a second table so
+// kfree can find the site to credit. Both tables are whole pages
+// taken when the profiler is turned on and given back when it is
+// turned off, so it costs nothing but a flag test when off. Blocks
+// allocated while it was off are not counted when freed.
+//
+// Both tables are open-addressed hash tables; sites are never
+// removed, and blocks are removed by shifting later entries back.
+// When either table fills up, allocations are counted as dropped.
+//
+
+#define KPROF_SITEBITS 8
+#define KPROF_NSITES (1U << KPROF_SITEBITS)
+#define KPROF_BLOCKBITS 12
+#define KPROF_NBLOCKS (1U << KPROF_BLOCKBITS)
+#define KPROF_MAXBLOCKS (KPROF_NBLOCKS / 4 * 3)
+
+struct kprof_site {
+	vaddr_t site;		/* caller's return address, 0 if unused */
+	size_t livebytes;	/* bytes allocated and not yet freed */
+	unsigned livecount;	/* blocks allocated and not yet freed */
+	unsigned allocs;	/* blocks allocated in total */
+};
+
+struct kprof_block {
+	vaddr_t addr;		/* block address, 0 if unused */
+	size_t size;		/* size asked for */
+	unsigned site;		/* index in kprof_sites */
+};
+
+#define KPROF_SITEPAGES \
+	DIVROUNDUP(KPROF_NSITES * sizeof(struct kprof_site), PAGE_SIZE)
+#define KPROF_BLOCKPAGES \
+	DIVROUNDUP(KPROF_NBLOCKS * sizeof(struct kprof_block), PAGE_SIZE)
+
+static struct spinlock kprof_spinlock = SPINLOCK_INITIALIZER;
+static volatile bool kprof_enabled;
+static struct kprof_site *kprof_sites;
+static struct kprof_block *kprof_blocks;
+static unsigned kprof_nblocks;
+static unsigned kprof_dropped;
+
+static
+inline
+unsigned
+kprof_hash(vaddr_t addr, unsigned bits)
+{
+	return ((uint32_t)addr * 2654435761U) >> (32 - bits);
+}
+
+/*
+ * Charge a new block to the site it was allocated from.
+ */
+static
+void
+kprof_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	unsigned s, b;
+
+	spinlock_acquire(&kprof_spinlock);
+	if (kprof_sites == NULL) {
+		/* turned off behind our back */
+		spinlock_release(&kprof_spinlock);
+		return;
+	}
+
+	s = kprof_hash(caller, KPROF_SITEBITS);
+	while (kprof_sites[s].site != caller && kprof_sites[s].site != 0) {
+		s = (s + 1) % KPROF_NSITES;
+		if (s == kprof_hash(caller, KPROF_SITEBITS)) {
+			/* no room for another site */
+			kprof_dropped++;
+			spinlock_release(&kprof_spinlock);
+			return;
+		}
+	}
+	kprof_sites[s].site = caller;
+	kprof_sites[s].allocs++;
+
+	if (kprof_nblocks >= KPROF_MAXBLOCKS) {
+		kprof_dropped++;
+		spinlock_release(&kprof_spinlock);
+		return;
+	}
+
+	b = kprof_hash((vaddr_t)ptr, KPROF_BLOCKBITS);
+	while (kprof_blocks[b].addr != 0) {
+		KASSERT(kprof_blocks[b].addr != (vaddr_t)ptr);
+		b = (b + 1) % KPROF_NBLOCKS;
+	}
+	kprof_blocks[b].addr = (vaddr_t)ptr;
+	kprof_blocks[b].size = sz;
+	kprof_blocks[b].site = s;
+	kprof_nblocks++;
+
+	kprof_sites[s].livebytes += sz;
+	kprof_sites[s].livecount++;
+
+	spinlock_release(&kprof_spinlock);
+}
+
+/*
+ * Credit a block being freed back to its site, if it was counted.
+ */
+static
+void
+kprof_free(void *ptr)
+{
+	unsigned b, i, home;
+	struct kprof_site *site;
+
+	spinlock_acquire(&kprof_spinlock);
+	if (kprof_blocks == NULL) {
+		spinlock_release(&kprof_spinlock);
+		return;
+	}
+
+	b = kprof_hash((vaddr_t)ptr, KPROF_BLOCKBITS);
+	while (kprof_blocks[b].addr != (vaddr_t)ptr) {
+		if (kprof_blocks[b].addr == 0) {
+			/* allocated before the profiler was on */
+			spinlock_release(&kprof_spinlock);
+			return;
+		}
+		b = (b + 1) % KPROF_NBLOCKS;
+	}
+
+	site = &kprof_sites[kprof_blocks[b].site];
+	KASSERT(site->livecount > 0);
+	KASSERT(site->livebytes >= kprof_blocks[b].size);
+	site->livebytes -= kprof_blocks[b].size;
+	site->livecount--;
+	kprof_nblocks--;
+
+	/*
+	 * Close the gap: move back any later entry in the run that
+	 * can't be found from its home slot past the empty one.
+	 */
+	i = b;
+	while (1) {
+		i = (i + 1) % KPROF_NBLOCKS;
+		if (kprof_blocks[i].addr == 0) {
+			break;
+		}
+		home = kprof_hash(kprof_blocks[i].addr, KPROF_BLOCKBITS);
+		if ((i - home) % KPROF_NBLOCKS >= (i - b) % KPROF_NBLOCKS) {
+			kprof_blocks[b] = kprof_blocks[i];
+			b = i;
+		}
+	}
+	kprof_blocks[b].addr = 0;
+
+	spinlock_release(&kprof_spinlock);
+}
+
+/*
+ * Turn the profiler on (starting from empty tables) or off.
+ */
+void
+kheap_profile(bool on)
+{
+	vaddr_t sites, blocks;
+	unsigned i;
+
+	if (on) {
+		sites = alloc_kpages(KPROF_SITEPAGES);
+		blocks = alloc_kpages(KPROF_BLOCKPAGES);
+		if (sites == 0 || blocks == 0) {
+			kprintf("kmalloc: No memory for the heap profiler\n");
+			if (sites != 0) {
+				free_kpages(sites);
+			}
+			if (blocks != 0) {
+				free_kpages(blocks);
+			}
+			return;
+		}
+		kprof_sites = (struct kprof_site *)sites;
+		for (i=0; i<KPROF_NSITES; i++) {
+			kprof_sites[i].site = 0;
+			kprof_sites[i].livebytes = 0;
+			kprof_sites[i].livecount = 0;
+			kprof_sites[i].allocs = 0;
+		}
+		kprof_blocks = (struct kprof_block *)blocks;
+		for (i=0; i<KPROF_NBLOCKS; i++) {
+			kprof_blocks[i].addr = 0;
+		}
+	}
+	else {
+		sites = blocks = 0;
+	}
+
+	spinlock_acquire(&kprof_spinlock);
+	if (on == kprof_enabled) {
+		/* nothing to do; drop what we just got, if anything */
+		spinlock_release(&kprof_spinlock);
+		if (on) {
+			free_kpages(sites);
+			free_kpages(blocks);
+		}
+		return;
+	}
+	if (on) {
+		kprof_nblocks = 0;
+		kprof_dropped = 0;
+	}
+	else {
+		sites = (vaddr_t)kprof_sites;
+		blocks = (vaddr_t)kprof_blocks;
+		kprof_sites = NULL;
+		kprof_blocks = NULL;
+	}
+	kprof_enabled = on;
+	spinlock_release(&kprof_spinlock);
+
+	if (!on) {
+		free_kpages(sites);
+		free_kpages(blocks);
+	}
+}
+
+/*
+ * Print the sites with live memory, most live bytes first, and how
+ * many blocks each has allocated altogether.
+ */
+void
+kheap_profdump(void)
+{
+	unsigned i, best, nsites;
+	size_t lastbytes, totalbytes;
+	unsigned lastindex;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kprof_spinlock);
+	if (kprof_sites == NULL) {
+		spinlock_release(&kprof_spinlock);
+		kprintf("Heap profiler is off; turn it on with khprof on.\n");
+		return;
+	}
+
+	kprintf("%-10s %10s %8s %8s\n", "site", "live bytes", "live",
+		"allocs");
+
+	/* Selection sort on (livebytes, index), printing as we go. */
+	lastbytes = (size_t)-1;
+	lastindex = KPROF_NSITES;
+	nsites = 0;
+	totalbytes = 0;
+	while (1) {
+		best = KPROF_NSITES;
+		for (i=0; i<KPROF_NSITES; i++) {
+			if (kprof_sites[i].site == 0) {
+				continue;
+			}
+			if (kprof_sites[i].livebytes > lastbytes ||
+			    (kprof_sites[i].livebytes == lastbytes &&
+			     i >= lastindex)) {
+				/* already printed */
+				continue;
+			}
+			if (best == KPROF_NSITES ||
+			    kprof_sites[i].livebytes >
+			    kprof_sites[best].livebytes) {
+				best = i;
+			}
+		}
+		if (best == KPROF_NSITES) {
+			break;
+		}
+		kprintf("0x%08lx %10lu %8u %8u\n",
+			(unsigned long)kprof_sites[best].site,
+			(unsigned long)kprof_sites[best].livebytes,
+			kprof_sites[best].livecount,
+			kprof_sites[best].allocs);
+		totalbytes += kprof_sites[best].livebytes;
+		nsites++;
+		lastbytes = kprof_sites[best].livebytes;
+		lastindex = best;
+	}
+
+	kprintf("%u sites, %lu live bytes in %u blocks, %u allocations "
+		"dropped\n", nsites, (unsigned long)totalbytes, kprof_nblocks,
+		kprof_dropped);
+	spinlock_release(&kprof_spinlock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
  * alloc_kpages depending on how big SZ is.
  */
+static
 void *
-kmalloc(size_t sz)
-{
-	size_t checksz;
+kmalloc_block(size_t sz
 #ifdef LABELS
-	vaddr_t label;
+	      , vaddr_t label
 #endif
-
-#ifdef LABELS
-#ifdef __GNUC__
-	label = (vaddr_t)__builtin_return_address(0);
-#else
-#error "Don't know how to get return address with this compiler"
-#endif /* __GNUC__ */
-#endif /* LABELS */
+	)
+{
+	size_t checksz;
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+	if (checksz > LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
@@ -1192,6 +1839,20 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	{
+		unsigned blktype = blocktype(sz);
+		void *ptr;
+
+		if (sizes[blktype] <= KMAG_MAXSIZE) {
+			ptr = kmag_alloc(blktype);
+			if (ptr != NULL) {
+				return ptr;
+			}
+		}
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1199,6 +1860,32 @@ kmalloc(size_t sz)
 #endif
 }
 
+/*
+ * Allocate a block of size SZ on behalf of CALLER, which is what the
+ * block is charged to by LABELS and the profiler.
+ */
+void *
+kmalloc_site(size_t sz, const void *caller)
+{
+	void *ptr;
+
+#ifdef LABELS
+	ptr = kmalloc_block(sz, (vaddr_t)caller);
+#else
+	ptr = kmalloc_block(sz);
+#endif
+	if (ptr != NULL && kprof_enabled) {
+		kprof_alloc(ptr, sz, (vaddr_t)caller);
+	}
+	return ptr;
+}
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_site(sz, KMALLOC_CALLER());
+}
+
 /*
  * Free a block previously returned from kmalloc.
  */
@@ -1208,9 +1895,35 @@ kfree(void *ptr)
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
+#ifdef MAGAZINES
+	struct pageref *pr;
+	unsigned blktype;
+#endif
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	if (kprof_enabled) {
+		kprof_free(ptr);
+	}
+#ifdef MAGAZINES
+	/*
+	 * The block is allocated, so its page and pageref stay put
+	 * while we look.
+	 */
+	pr = NULL;
+	if (pagerefs_indexed) {
+		pr = coremap_getkheap((vaddr_t)ptr & PAGE_FRAME);
+	}
+	if (pr != NULL) {
+		blktype = PR_BLOCKTYPE(pr);
+		if (sizes[blktype] <= KMAG_MAXSIZE &&
+		    kmag_free(ptr, blktype) == 0) {
+			return;
+		}
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
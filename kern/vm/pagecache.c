@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Page cache for memory-mapped files.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <array.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <vmstats.h>
+#include <pagecache.h>
+
+/*
+ * A cached page of a file.
+ */
+struct pcpage {
+	off_t pp_offset;		/* Page-aligned offset in the file */
+	paddr_t pp_paddr;		/* Physical page */
+	bool pp_dirty;			/* Written through a mapping */
+};
+
+DECLARRAY(pcpage, static __UNUSED inline);
+DEFARRAY(pcpage, static __UNUSED inline);
+
+/*
+ * The cache for one vnode. pc_pages is sorted by offset.
+ */
+struct pagecache {
+	struct lock *pc_lock;		/* Protects everything here */
+	struct pcpagearray pc_pages;	/* Cached pages */
+	unsigned pc_maps;		/* Number of mappings */
+};
+
+static
+struct pagecache *
+pagecache_create(void)
+{
+	struct pagecache *pc;
+
+	pc = kmalloc(sizeof(*pc));
+	if (pc == NULL) {
+		return NULL;
+	}
+	pc->pc_lock = lock_create("pagecache");
+	if (pc->pc_lock == NULL) {
+		kfree(pc);
+		return NULL;
+	}
+	pcpagearray_init(&pc->pc_pages);
+	pc->pc_maps = 0;
+	return pc;
+}
+
+static
+void
+pagecache_free(struct pagecache *pc)
+{
+	KASSERT(pcpagearray_num(&pc->pc_pages) == 0);
+	KASSERT(pc->pc_maps == 0);
+
+	pcpagearray_cleanup(&pc->pc_pages);
+	lock_destroy(pc->pc_lock);
+	kfree(pc);
+}
+
+/*
+ * Binary search for OFFSET. Returns the index of the page if it is
+ * cached, otherwise the index it would be inserted at.
+ */
+static
+unsigned
+pagecache_find(struct pagecache *pc, off_t offset, bool *found)
+{
+	unsigned lo, hi, mid;
+	struct pcpage *pp;
+
+	lo = 0;
+	hi = pcpagearray_num(&pc->pc_pages);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		pp = pcpagearray_get(&pc->pc_pages, mid);
+		if (pp->pp_offset == offset) {
+			*found = true;
+			return mid;
+		}
+		if (pp->pp_offset < offset) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	*found = false;
+	return lo;
+}
+
+/*
+ * Insert PP at INDEX, keeping the array sorted.
+ */
+static
+int
+pagecache_insert(struct pagecache *pc, unsigned index, struct pcpage *pp)
+{
+	unsigned num, i;
+	int result;
+
+	num = pcpagearray_num(&pc->pc_pages);
+	result = pcpagearray_setsize(&pc->pc_pages, num + 1);
+	if (result) {
+		return result;
+	}
+	for (i = num; i > index; i--) {
+		pcpagearray_set(&pc->pc_pages, i,
+				pcpagearray_get(&pc->pc_pages, i - 1));
+	}
+	pcpagearray_set(&pc->pc_pages, index, pp);
+	return 0;
+}
+
+/*
+ * Move a page between memory and the file. Writes are clipped to the
+ * file size so a mapping never makes the file grow; reads past the
+ * end of the file leave the rest of the (zeroed) page alone.
+ */
+static
+int
+pagecache_io(struct vnode *vn, struct pcpage *pp, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	size_t len;
+	int result;
+
+	len = PAGE_SIZE;
+	if (rw == UIO_WRITE) {
+		result = VOP_STAT(vn, &st);
+		if (result) {
+			return result;
+		}
+		if (st.st_size <= pp->pp_offset) {
+			return 0;
+		}
+		if (st.st_size - pp->pp_offset < PAGE_SIZE) {
+			len = st.st_size - pp->pp_offset;
+		}
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pp->pp_paddr), len,
+		  pp->pp_offset, rw);
+	if (rw == UIO_READ) {
+		return VOP_READ(vn, &ku);
+	}
+	return VOP_WRITE(vn, &ku);
+}
+
+int
+pagecache_attach(struct vnode *vn)
+{
+	struct pagecache *pc, *newpc;
+
+	newpc = NULL;
+	if (vn->vn_pagecache == NULL) {
+		newpc = pagecache_create();
+		if (newpc == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	/* Someone else may have gotten there first */
+	spinlock_acquire(&vn->vn_countlock);
+	if (vn->vn_pagecache == NULL) {
+		vn->vn_pagecache = newpc;
+		newpc = NULL;
+	}
+	pc = vn->vn_pagecache;
+	spinlock_release(&vn->vn_countlock);
+
+	if (newpc != NULL) {
+		pagecache_free(newpc);
+	}
+
+	lock_acquire(pc->pc_lock);
+	pc->pc_maps++;
+	lock_release(pc->pc_lock);
+
+	return 0;
+}
+
+static
+int
+pagecache_sync_locked(struct vnode *vn, struct pagecache *pc)
+{
+	struct pcpage *pp;
+	unsigned i;
+	int result, ret;
+
+	KASSERT(lock_do_i_hold(pc->pc_lock));
+
+	/* Try every page even if one fails */
+	ret = 0;
+	for (i = 0; i < pcpagearray_num(&pc->pc_pages); i++) {
+		pp = pcpagearray_get(&pc->pc_pages, i);
+		if (pp->pp_dirty) {
+			result = pagecache_io(vn, pp, UIO_WRITE);
+			if (result) {
+				ret = result;
+			}
+		}
+	}
+	return ret;
+}
+
+void
+pagecache_detach(struct vnode *vn)
+{
+	struct pagecache *pc = vn->vn_pagecache;
+	struct pcpage *pp;
+	unsigned i;
+	int result;
+
+	KASSERT(pc != NULL);
+
+	lock_acquire(pc->pc_lock);
+	KASSERT(pc->pc_maps > 0);
+	pc->pc_maps--;
+	if (pc->pc_maps == 0) {
+		result = pagecache_sync_locked(vn, pc);
+		if (result) {
+			kprintf("pagecache: writeback failed: %s\n",
+				strerror(result));
+		}
+		for (i = 0; i < pcpagearray_num(&pc->pc_pages); i++) {
+			pp = pcpagearray_get(&pc->pc_pages, i);
+			free_upage(pp->pp_paddr);
+			kfree(pp);
+		}
+		pcpagearray_setsize(&pc->pc_pages, 0);
+	}
+	lock_release(pc->pc_lock);
+}
+
+int
+pagecache_getpage(struct vnode *vn, off_t offset, bool write, paddr_t *ret)
+{
+	struct pagecache *pc = vn->vn_pagecache;
+	struct pcpage *pp;
+	unsigned index;
+	bool found;
+	int result;
+
+	KASSERT(pc != NULL);
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pc->pc_lock);
+	KASSERT(pc->pc_maps > 0);
+
+	index = pagecache_find(pc, offset, &found);
+	if (found) {
+		pp = pcpagearray_get(&pc->pc_pages, index);
+	}
+	else {
+		pp = kmalloc(sizeof(*pp));
+		if (pp == NULL) {
+			lock_release(pc->pc_lock);
+			return ENOMEM;
+		}
+		pp->pp_offset = offset;
+		pp->pp_dirty = false;
+		pp->pp_paddr = alloc_upage();
+		if (pp->pp_paddr == 0) {
+			kfree(pp);
+			lock_release(pc->pc_lock);
+			return ENOMEM;
+		}
+
+		result = pagecache_io(vn, pp, UIO_READ);
+		if (result == 0) {
+			vmstats_inc(VMSTAT_FILEIN);
+			result = pagecache_insert(pc, index, pp);
+		}
+		if (result) {
+			free_upage(pp->pp_paddr);
+			kfree(pp);
+			lock_release(pc->pc_lock);
+			return result;
+		}
+	}
+
+	if (write) {
+		pp->pp_dirty = true;
+	}
+	coremap_incref(pp->pp_paddr);
+	*ret = pp->pp_paddr;
+
+	lock_release(pc->pc_lock);
+	return 0;
+}
+
+int
+pagecache_sync(struct vnode *vn)
+{
+	struct pagecache *pc = vn->vn_pagecache;
+	int result;
+
+	if (pc == NULL) {
+		return 0;
+	}
+
+	lock_acquire(pc->pc_lock);
+	result = pagecache_sync_locked(vn, pc);
+	lock_release(pc->pc_lock);
+
+	return result;
+}
+
+void
+pagecache_destroy(struct vnode *vn)
+{
+	if (vn->vn_pagecache != NULL) {
+		pagecache_free(vn->vn_pagecache);
+		vn->vn_pagecache = NULL;
+	}
+}
@@ -0,0 +1,688 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap space management.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+#include <vmstats.h>
+
+/*
+ * Slots are numbered independently of where their page ends up: in
+ * the compressed pool, or in a block of the swap device. There are as
+ * many as the device has blocks plus what the pool is counted on to
+ * hold. Everything here is protected by swap_lock.
+ */
+static struct bitmap *swap_map;		/* Slots in use; NULL if no swap */
+static unsigned swap_nslots;		/* Number of slots */
+static unsigned swap_inuse;		/* Number of slots in use */
+static int *swap_block;			/* Device block of each slot (-1 if none) */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct vnode *swap_vnode;	/* Swap device; NULL if none */
+static struct bitmap *swap_blockmap;	/* Device blocks in use */
+static unsigned swap_nblocks;		/* Number of blocks on the device */
+
+/*
+ * Compressed pool. It starts out empty and takes pages as it needs
+ * room, up to swap_zmaxpages; they stay in the pool once taken. Chunk
+ * N is in pool page N / SWAP_ZPERPAGE. The chunk lists and counters
+ * are protected by swap_lock; the scratch buffers by swap_zlock. A
+ * slot's chunks belong to whoever owns the slot, so copying into them
+ * needs no lock.
+ */
+#define SWAP_ZPERPAGE (PAGE_SIZE / SWAP_ZCHUNK)
+
+static char **swap_zpool;		/* Pool pages */
+static unsigned swap_zmaxpages;		/* Most pages the pool may take */
+static unsigned swap_znpages;		/* Pages taken so far */
+static int *swap_znext;			/* Next chunk of each chunk's chain */
+static int swap_zfree;			/* First free chunk (-1 if none) */
+static unsigned swap_nzfree;		/* Number of free chunks */
+static int *swap_zhead;			/* First chunk of each slot (-1 if none) */
+static uint16_t *swap_zlen;		/* Compressed size of each slot */
+static unsigned swap_zpages;		/* Pages in the pool */
+static unsigned swap_zbytes;		/* Their compressed size */
+
+static struct lock *swap_zlock;
+static uint8_t swap_zbuf[PAGE_SIZE + PAGE_SIZE / 8 + 1];
+static uint16_t swap_zhash[4096];
+
+/*
+ * Open the swap device, if there is one. Running out of memory
+ * without a device isn't fatal, so neither is a missing one.
+ */
+static
+void
+swap_devbootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	/* vfs_open may modify the path it's given */
+	strcpy(path, SWAP_DEVICE);
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: no swap device %s: %s\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: stat of %s failed: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nblocks = st.st_size / PAGE_SIZE;
+	swap_blockmap = bitmap_create(swap_nblocks);
+	if (swap_blockmap == NULL) {
+		panic("swap: Out of memory creating swap bitmap\n");
+	}
+
+	kprintf("swap: %u pages on %s\n", swap_nblocks, SWAP_DEVICE);
+}
+
+/*
+ * Set up the bookkeeping of the compressed pool. Its pages come later.
+ */
+static
+void
+swap_zbootstrap(void)
+{
+	unsigned nchunks;
+
+	swap_zmaxpages = ram_getsize() / PAGE_SIZE / SWAP_ZPOOL_FRACTION;
+	if (swap_zmaxpages == 0) {
+		return;
+	}
+	nchunks = swap_zmaxpages * SWAP_ZPERPAGE;
+
+	swap_zlock = lock_create("swapz");
+	swap_zpool = kmalloc(swap_zmaxpages * sizeof(char *));
+	swap_znext = kmalloc(nchunks * sizeof(int));
+	if (swap_zlock == NULL || swap_zpool == NULL || swap_znext == NULL) {
+		panic("swap: Out of memory creating compressed pool\n");
+	}
+	swap_zfree = -1;
+
+	kprintf("swap: compressed pool of up to %u pages\n", swap_zmaxpages);
+}
+
+/*
+ * Set up the slots for the device and the pool.
+ */
+void
+swap_bootstrap(void)
+{
+	unsigned i;
+
+	swap_devbootstrap();
+	swap_zbootstrap();
+
+	swap_nslots = swap_nblocks + swap_zmaxpages * SWAP_ZRATIO;
+	if (swap_nslots == 0) {
+		return;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	swap_block = kmalloc(swap_nslots * sizeof(int));
+	if (swap_map == NULL || swap_block == NULL) {
+		panic("swap: Out of memory creating swap slots\n");
+	}
+	for (i = 0; i < swap_nslots; i++) {
+		swap_block[i] = -1;
+	}
+
+	if (swap_zmaxpages > 0) {
+		swap_zhead = kmalloc(swap_nslots * sizeof(int));
+		swap_zlen = kmalloc(swap_nslots * sizeof(uint16_t));
+		if (swap_zhead == NULL || swap_zlen == NULL) {
+			panic("swap: Out of memory creating swap slots\n");
+		}
+		for (i = 0; i < swap_nslots; i++) {
+			swap_zhead[i] = -1;
+		}
+	}
+}
+
+/*
+ * Reserve a free slot. Returns ENOSPC if all slots are in use or there
+ * is no swap at all. Whether the page will fit anywhere is only known
+ * when it is written.
+ */
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_map == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_inuse++;
+	}
+	spinlock_release(&swap_lock);
+
+	return result;
+}
+
+/*
+ * Put the chunks of a slot back on the free list. Called with
+ * swap_lock held.
+ */
+static
+void
+swap_zrelease(unsigned slot)
+{
+	int first, last;
+
+	KASSERT(spinlock_do_i_hold(&swap_lock));
+
+	first = swap_zhead[slot];
+	if (first == -1) {
+		return;
+	}
+
+	last = first;
+	swap_nzfree++;
+	while (swap_znext[last] != -1) {
+		last = swap_znext[last];
+		swap_nzfree++;
+	}
+	swap_znext[last] = swap_zfree;
+	swap_zfree = first;
+
+	swap_zhead[slot] = -1;
+	swap_zpages--;
+	swap_zbytes -= swap_zlen[slot];
+}
+
+/*
+ * Release a slot, and whatever holds its page.
+ */
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_inuse--;
+	if (swap_zhead != NULL) {
+		swap_zrelease(slot);
+	}
+	if (swap_block[slot] != -1) {
+		bitmap_unmark(swap_blockmap, swap_block[slot]);
+		swap_block[slot] = -1;
+	}
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * LZ77 compression of a page into DST, which has room for DSTMAX
+ * bytes. Groups of eight items are preceded by a byte of flags, one
+ * bit per item (lowest first): 0 for a literal byte, 1 for a match.
+ * A match is two bytes, the length minus 3 in the top 4 bits and
+ * the 12-bit distance back in the rest. A length field of 15 is
+ * followed by a byte more of length.
+ *
+ * Candidate matches come from a hash table of recent positions. It
+ * isn't cleared between pages; stale entries just fail to match.
+ *
+ * Returns the compressed size, or 0 if it doesn't fit in DSTMAX.
+ * Called with swap_zlock held.
+ */
+static
+size_t
+swap_compress(const uint8_t *src, uint8_t *dst, size_t dstmax)
+{
+	size_t in, out, flagpos, len, dist, cand;
+	unsigned bit, h;
+
+	in = out = flagpos = 0;
+	bit = 8;
+	while (in < PAGE_SIZE) {
+		if (bit == 8) {
+			if (out >= dstmax) {
+				return 0;
+			}
+			flagpos = out++;
+			dst[flagpos] = 0;
+			bit = 0;
+		}
+
+		len = 0;
+		if (in + 3 <= PAGE_SIZE) {
+			h = ((src[in] << 4) ^ (src[in+1] << 2) ^ src[in+2]) & 4095;
+			cand = swap_zhash[h];
+			swap_zhash[h] = in;
+			if (cand < in && in - cand < 4096 &&
+			    src[cand] == src[in] && src[cand+1] == src[in+1] &&
+			    src[cand+2] == src[in+2]) {
+				len = 3;
+				while (len < 3 + 15 + 255 && in + len < PAGE_SIZE &&
+				       src[cand+len] == src[in+len]) {
+					len++;
+				}
+			}
+		}
+
+		if (len > 0) {
+			if (out + 3 > dstmax) {
+				return 0;
+			}
+			dist = in - cand;
+			if (len >= 3 + 15) {
+				dst[out++] = (15 << 4) | (dist >> 8);
+				dst[out++] = dist & 0xff;
+				dst[out++] = len - 3 - 15;
+			}
+			else {
+				dst[out++] = ((len - 3) << 4) | (dist >> 8);
+				dst[out++] = dist & 0xff;
+			}
+			dst[flagpos] |= 1 << bit;
+			in += len;
+		}
+		else {
+			if (out >= dstmax) {
+				return 0;
+			}
+			dst[out++] = src[in++];
+		}
+		bit++;
+	}
+	return out;
+}
+
+/*
+ * Undo swap_compress. Returns EIO if the data is corrupt.
+ */
+static
+int
+swap_decompress(const uint8_t *src, size_t srclen, uint8_t *dst)
+{
+	size_t in, out, len, dist, i;
+	unsigned bit, flags;
+
+	in = out = 0;
+	bit = 8;
+	flags = 0;
+	while (out < PAGE_SIZE) {
+		if (bit == 8) {
+			if (in >= srclen) {
+				return EIO;
+			}
+			flags = src[in++];
+			bit = 0;
+		}
+
+		if (flags & (1 << bit)) {
+			if (in + 2 > srclen) {
+				return EIO;
+			}
+			len = (src[in] >> 4) + 3;
+			dist = ((src[in] & 0xf) << 8) | src[in+1];
+			in += 2;
+			if (len == 3 + 15) {
+				if (in >= srclen) {
+					return EIO;
+				}
+				len += src[in++];
+			}
+			if (dist == 0 || dist > out || out + len > PAGE_SIZE) {
+				return EIO;
+			}
+			/* Byte at a time, the match may overlap itself */
+			for (i = 0; i < len; i++) {
+				dst[out + i] = dst[out - dist + i];
+			}
+			out += len;
+		}
+		else {
+			if (in >= srclen) {
+				return EIO;
+			}
+			dst[out++] = src[in++];
+		}
+		bit++;
+	}
+	return 0;
+}
+
+
+/* Where chunk N of the pool is */
+static
+char *
+swap_zchunk(int chunk)
+{
+	return swap_zpool[chunk / SWAP_ZPERPAGE] +
+		(chunk % SWAP_ZPERPAGE) * SWAP_ZCHUNK;
+}
+
+/*
+ * Add the page at KBUF to the pool. Called with swap_lock held.
+ */
+static
+void
+swap_zgrow(void *kbuf)
+{
+	int first;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&swap_lock));
+	KASSERT(swap_znpages < swap_zmaxpages);
+
+	first = swap_znpages * SWAP_ZPERPAGE;
+	swap_zpool[swap_znpages++] = kbuf;
+	for (i = 0; i < SWAP_ZPERPAGE; i++) {
+		swap_znext[first + i] = i + 1 < SWAP_ZPERPAGE ?
+			first + (int)i + 1 : swap_zfree;
+	}
+	swap_zfree = first;
+	swap_nzfree += SWAP_ZPERPAGE;
+}
+
+/*
+ * Try to keep a page in the compressed pool. Returns ENOSPC if it
+ * doesn't compress well enough or the pool is full.
+ *
+ * If the pool is out of chunks but may still grow, and POOLED is not
+ * NULL, the page at KBUF itself is added to it once its contents are
+ * compressed, and *POOLED is set; the caller must forget the page.
+ * That way the pool grows under memory pressure without allocating.
+ */
+static
+int
+swap_zwrite(void *kbuf, unsigned slot, bool *pooled)
+{
+	size_t len, done, n;
+	unsigned nchunks, i;
+	int first, chunk;
+
+	lock_acquire(swap_zlock);
+
+	len = swap_compress(kbuf, swap_zbuf, SWAP_ZMAX);
+	if (len == 0) {
+		lock_release(swap_zlock);
+		return ENOSPC;
+	}
+	nchunks = (len + SWAP_ZCHUNK - 1) / SWAP_ZCHUNK;
+
+	spinlock_acquire(&swap_lock);
+	if (swap_nzfree < nchunks && pooled != NULL &&
+	    swap_znpages < swap_zmaxpages) {
+		swap_zgrow(kbuf);
+		*pooled = true;
+	}
+	if (swap_nzfree < nchunks) {
+		spinlock_release(&swap_lock);
+		lock_release(swap_zlock);
+		return ENOSPC;
+	}
+	first = chunk = swap_zfree;
+	for (i = 1; i < nchunks; i++) {
+		chunk = swap_znext[chunk];
+	}
+	swap_zfree = swap_znext[chunk];
+	swap_znext[chunk] = -1;
+	swap_nzfree -= nchunks;
+	spinlock_release(&swap_lock);
+
+	for (chunk = first, done = 0; chunk != -1; chunk = swap_znext[chunk]) {
+		n = len - done < SWAP_ZCHUNK ? len - done : SWAP_ZCHUNK;
+		memcpy(swap_zchunk(chunk), swap_zbuf + done, n);
+		done += n;
+	}
+
+	lock_release(swap_zlock);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_zhead[slot] == -1);
+	swap_zhead[slot] = first;
+	swap_zlen[slot] = len;
+	swap_zpages++;
+	swap_zbytes += len;
+	spinlock_release(&swap_lock);
+
+	return 0;
+}
+
+/*
+ * Read a page back out of the compressed pool.
+ */
+static
+int
+swap_zread(void *kbuf, unsigned slot)
+{
+	size_t len, done, n;
+	int chunk;
+	int result;
+
+	lock_acquire(swap_zlock);
+
+	len = swap_zlen[slot];
+	for (chunk = swap_zhead[slot], done = 0; chunk != -1;
+	     chunk = swap_znext[chunk]) {
+		n = len - done < SWAP_ZCHUNK ? len - done : SWAP_ZCHUNK;
+		memcpy(swap_zbuf + done, swap_zchunk(chunk), n);
+		done += n;
+	}
+	result = swap_decompress(swap_zbuf, len, kbuf);
+
+	lock_release(swap_zlock);
+	return result;
+}
+
+/*
+ * Move a page between memory and a block of the swap device.
+ */
+static
+int
+swap_io(void *kbuf, unsigned block, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(block < swap_nblocks);
+
+	uio_kinit(&iov, &ku, kbuf, PAGE_SIZE, (off_t)block * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* short transfer; swap device is broken */
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Give a slot a block of the swap device. Returns ENOSPC if the
+ * device is full or there is none.
+ */
+static
+int
+swap_allocblock(unsigned slot)
+{
+	unsigned block;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_block[slot] == -1);
+	result = bitmap_alloc(swap_blockmap, &block);
+	if (result == 0) {
+		swap_block[slot] = block;
+	}
+	spinlock_release(&swap_lock);
+
+	return result;
+}
+
+/*
+ * Move a page between memory and its swap slot, wherever it is.
+ */
+static
+int
+swap_read(void *kbuf, unsigned slot)
+{
+	if (swap_zhead != NULL && swap_zhead[slot] != -1) {
+		return swap_zread(kbuf, slot);
+	}
+	KASSERT(swap_block[slot] != -1);
+	return swap_io(kbuf, swap_block[slot], UIO_READ);
+}
+
+static
+int
+swap_write(void *kbuf, unsigned slot, bool *pooled)
+{
+	int result;
+
+	if (swap_zhead != NULL && swap_zwrite(kbuf, slot, pooled) == 0) {
+		vmstats_inc(VMSTAT_SWAP_ZSTORE);
+		return 0;
+	}
+
+	result = swap_allocblock(slot);
+	if (result) {
+		return result;
+	}
+	vmstats_inc(VMSTAT_SWAP_DISK);
+	return swap_io(kbuf, swap_block[slot], UIO_WRITE);
+}
+
+int
+swap_in(paddr_t paddr, unsigned slot)
+{
+	return swap_read((void *)PADDR_TO_KVADDR(paddr), slot);
+}
+
+int
+swap_out(paddr_t paddr, unsigned slot, bool *pooled)
+{
+	*pooled = false;
+	return swap_write((void *)PADDR_TO_KVADDR(paddr), slot, pooled);
+}
+
+/*
+ * Give a forked address space its own copy of a swapped out page.
+ */
+int
+swap_dup(unsigned slot, unsigned *newslot)
+{
+	void *buf;
+	int result;
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = swap_alloc(newslot);
+	if (result) {
+		kfree(buf);
+		return result;
+	}
+
+	/* buf is kmalloc'd, so the pool mustn't keep it */
+	result = swap_read(buf, slot);
+	if (result == 0) {
+		result = swap_write(buf, *newslot, NULL);
+	}
+	if (result) {
+		swap_free(*newslot);
+	}
+
+	kfree(buf);
+	return result;
+}
+
+/*
+ * Print how full the compressed pool is and how well it compresses.
+ */
+void
+swap_printstats(void)
+{
+	unsigned pages, bytes, nfree, npages, ratio;
+
+	if (swap_zmaxpages == 0) {
+		kprintf("Compressed swap: none\n");
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	pages = swap_zpages;
+	bytes = swap_zbytes;
+	nfree = swap_nzfree;
+	npages = swap_znpages;
+	spinlock_release(&swap_lock);
+
+	/* Hundredths, as there is no floating point in kprintf */
+	ratio = bytes == 0 ? 0 :
+		(unsigned)((uint64_t)pages * PAGE_SIZE * 100 / bytes);
+
+	kprintf("Compressed swap: %u pages in %u bytes (ratio %u.%02u), "
+		"pool of %u of up to %u pages, %u chunks free\n", pages,
+		bytes, ratio / 100, ratio % 100, npages, swap_zmaxpages,
+		nfree);
+}
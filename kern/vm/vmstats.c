@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VM event counters.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <vmstats.h>
+
+static const char *vmstat_names[VMSTAT_COUNT] = {
+	"TLB faults",
+	"TLB faults with free",
+	"TLB faults with replace",
+	"TLB flushes on switch",
+	"TLB retained on switch",
+	"Pre-zeroed pages used",
+	"Pages zeroed on demand",
+	"Zero page mappings",
+	"Pages mapped by fault-around",
+	"Copy-on-write copies",
+	"Pages read from swap",
+	"Pages read from files",
+	"Pages evicted to swap",
+	"TLB shootdowns",
+	"TLB shootdown IPIs",
+	"TLB shootdown full flushes",
+	"Swap pages compressed",
+	"Swap pages to disk",
+};
+
+/*
+ * The global counts are kept per cpu, so counting an event only takes
+ * this cpu's counter with interrupts off; they are summed when read.
+ *
+ * User processes have a single thread, which is the only one to touch
+ * its process's counters, so those need no lock either. The threads
+ * of kproc would race on them, so kernel threads only count globally.
+ */
+
+void
+vmstats_inc(unsigned index)
+{
+	struct proc *proc;
+	int spl;
+
+	KASSERT(index < VMSTAT_COUNT);
+
+	spl = splhigh();
+	curcpu->c_vmstats[index]++;
+	if (curthread != NULL && !curthread->t_in_interrupt) {
+		proc = curproc;
+		if (proc != NULL && proc != kproc) {
+			proc->p_vmstats[index]++;
+		}
+	}
+	splx(spl);
+}
+
+void
+vmstats_proc(struct proc *proc, unsigned *counts)
+{
+	unsigned i;
+
+	KASSERT(proc == curproc);
+
+	for (i = 0; i < VMSTAT_COUNT; i++) {
+		counts[i] = proc->p_vmstats[i];
+	}
+}
+
+/*
+ * Counters of other cpus are read and reset without stopping them,
+ * so an event counted at the same moment may be lost or show up late.
+ */
+void
+vmstats_reset(void)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	for (n = 0; n < cpu_count(); n++) {
+		c = cpu_get(n);
+		for (i = 0; i < VMSTAT_COUNT; i++) {
+			c->c_vmstats[i] = 0;
+		}
+	}
+}
+
+void
+vmstats_print(void)
+{
+	unsigned counts[VMSTAT_COUNT];
+	unsigned i, n;
+	struct cpu *c;
+
+	for (i = 0; i < VMSTAT_COUNT; i++) {
+		counts[i] = 0;
+	}
+	for (n = 0; n < cpu_count(); n++) {
+		c = cpu_get(n);
+		for (i = 0; i < VMSTAT_COUNT; i++) {
+			counts[i] += c->c_vmstats[i];
+		}
+	}
+
+	kprintf("VM statistics:\n");
+	for (i = 0; i < VMSTAT_COUNT; i++) {
+		kprintf("  %-24s %u\n", vmstat_names[i], counts[i]);
+	}
+}
@@ -421,11 +421,15 @@ docommand(char *buf, struct exitinfo *ei)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
+	/*
+	 * vfork: the child borrows our memory until it execs, which
+	 * saves copying the address space of the shell every time.
+	 */
+	pid = vfork();
 	switch (pid) {
 		case -1:
 			/* error */
-			warn("fork");
+			warn("vfork");
 			exitinfo_exit(ei, 255);
 			return;
 		case 0:
@@ -437,7 +441,8 @@ docommand(char *buf, struct exitinfo *ei)
 			 * process to avoid calling atexit() functions,
 			 * which would cause hostcompat (if present) to
 			 * reset the tty state and mess up our input
-			 * handling.
+			 * handling. After vfork, exit() would also
+			 * flush our stdio buffers out from under us.
 			 */
 			_exit(1);
 		default:
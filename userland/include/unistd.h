@@ -40,6 +40,7 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -57,6 +58,7 @@
  *     fstat:    sys/stat.h
  *     lstat:    sys/stat.h
  *     mkdir:    sys/stat.h
+ *     getrusage: sys/resource.h
  *
  * If this were standard Unix, more prototypes would go in other
  * header files as well, as follows:
@@ -112,6 +114,7 @@
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
+pid_t vfork(void);
 pid_t waitpid(pid_t pid, int *returncode, int flags);
 /*
  * Open actually takes either two or three args: the optional third
@@ -141,6 +144,10 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(__intptr_t change);
+/* mmap maps whole pages of a file at an address chosen by the kernel */
+void *mmap(size_t length, int prot, int filehandle, off_t offset);
+int munmap(void *addr, size_t length);
+#define MAP_FAILED ((void *)-1)	/* returned by mmap on error */
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
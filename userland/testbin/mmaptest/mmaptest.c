@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest - test mmap() and munmap().
+ *
+ * Maps a small file read-only and read/write and checks what comes
+ * back through read(), both after fsync and after munmap alone, writes
+ * to a file straight out of a mapping
+ * that has not been touched yet (so the write itself has to fault the
+ * pages in), and checks that bad arguments are refused.
+ *
+ * Needs a writable filesystem for the current directory.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		3
+#define FILESIZE	(PAGE_SIZE * NPAGES)
+
+#define TESTFILE	"mmaptest.dat"
+#define COPYFILE	"mmaptest.cpy"
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(unsigned pos, unsigned seed)
+{
+	return 'a' + (pos * 7 + seed) % 26;
+}
+
+static
+void
+fillbuf(unsigned seed)
+{
+	unsigned i;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = pattern(i, seed);
+	}
+}
+
+static
+void
+checkbuf(const volatile char *p, unsigned seed, const char *what)
+{
+	unsigned i;
+
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != pattern(i, seed)) {
+			errx(1, "FAILED: %s: wrong data at offset %u", what, i);
+		}
+	}
+}
+
+static
+void
+writefile(const char *name, unsigned seed)
+{
+	int fd, r;
+
+	fillbuf(seed);
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	r = write(fd, buf, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: write", name);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: write: short count %d", name, r);
+	}
+	close(fd);
+}
+
+static
+void
+readfile(const char *name)
+{
+	int fd, r;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	memset(buf, 0, FILESIZE);
+	r = read(fd, buf, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: read", name);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: read: short count %d", name, r);
+	}
+	close(fd);
+}
+
+static
+void *
+domap(int fd, int prot)
+{
+	void *p;
+
+	p = mmap(FILESIZE, prot, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+dounmap(void *p)
+{
+	if (munmap(p, FILESIZE) < 0) {
+		err(1, "munmap");
+	}
+}
+
+/*
+ * Map the file read-only and compare it with what was written.
+ */
+static
+void
+test_read(void)
+{
+	volatile char *p;
+	int fd;
+
+	printf("Mapping read-only...\n");
+	writefile(TESTFILE, 0);
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = domap(fd, PROT_READ);
+	close(fd);
+
+	checkbuf(p, 0, "read-only mapping");
+	dounmap((void *)p);
+}
+
+/*
+ * Map the file read/write, change every byte, unmap, and check that
+ * read() sees the changes.
+ */
+static
+void
+test_write(void)
+{
+	volatile char *p;
+	unsigned i;
+	int fd;
+
+	printf("Mapping read/write...\n");
+	writefile(TESTFILE, 0);
+	fd = open(TESTFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = domap(fd, PROT_READ|PROT_WRITE);
+
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 1);
+	}
+	if (fsync(fd) < 0) {
+		err(1, "%s: fsync", TESTFILE);
+	}
+	close(fd);
+	dounmap((void *)p);
+
+	readfile(TESTFILE);
+	checkbuf(buf, 1, "read after munmap");
+}
+
+/*
+ * Same, but leave writing the pages back to munmap.
+ */
+static
+void
+test_unmap(void)
+{
+	volatile char *p;
+	unsigned i;
+	int fd;
+
+	printf("Writing back on munmap...\n");
+	writefile(TESTFILE, 0);
+	fd = open(TESTFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = domap(fd, PROT_READ|PROT_WRITE);
+
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = pattern(i, 3);
+	}
+	dounmap((void *)p);
+	close(fd);
+
+	readfile(TESTFILE);
+	checkbuf(buf, 3, "read after munmap only");
+}
+
+/*
+ * Write another file directly from a mapping nobody has touched, so
+ * the pages get faulted in from one file while writing to another.
+ */
+static
+void
+test_writefrom(void)
+{
+	void *p;
+	int fd, copyfd, r;
+
+	printf("Writing from an untouched mapping...\n");
+	writefile(TESTFILE, 2);
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	p = domap(fd, PROT_READ);
+	close(fd);
+
+	copyfd = open(COPYFILE, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (copyfd < 0) {
+		err(1, "%s: create", COPYFILE);
+	}
+	r = write(copyfd, p, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: write", COPYFILE);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: write: short count %d", COPYFILE, r);
+	}
+	close(copyfd);
+	dounmap(p);
+
+	readfile(COPYFILE);
+	checkbuf(buf, 2, "write from mapping");
+	remove(COPYFILE);
+}
+
+/*
+ * Bad arguments: an unaligned offset, protections that are unknown or
+ * leave out PROT_READ, writable mapping of a read-only file, and
+ * munmap of only part of a mapping.
+ */
+static
+void
+test_bad(void)
+{
+	void *p;
+	int fd;
+
+	printf("Checking bad arguments...\n");
+	writefile(TESTFILE, 0);
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+
+	p = mmap(FILESIZE, PROT_READ, fd, 100);
+	if (p != MAP_FAILED) {
+		errx(1, "FAILED: mmap with unaligned offset succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "FAILED: mmap with unaligned offset: wrong error");
+	}
+
+	p = mmap(FILESIZE, PROT_READ|0x100, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "FAILED: mmap with unknown protection succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "FAILED: mmap with unknown protection: wrong error");
+	}
+
+	p = mmap(FILESIZE, PROT_NONE, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "FAILED: mmap with PROT_NONE succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "FAILED: mmap with PROT_NONE: wrong error");
+	}
+
+	p = mmap(FILESIZE, PROT_READ|PROT_WRITE, fd, 0);
+	if (p != MAP_FAILED) {
+		errx(1, "FAILED: writable mmap of read-only file succeeded");
+	}
+	if (errno != EACCES) {
+		err(1, "FAILED: writable mmap of read-only file: "
+		    "wrong error");
+	}
+
+	p = domap(fd, PROT_READ);
+	close(fd);
+	if (munmap(p, PAGE_SIZE) == 0) {
+		errx(1, "FAILED: partial munmap succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "FAILED: partial munmap: wrong error");
+	}
+	dounmap(p);
+}
+
+int
+main(void)
+{
+	test_read();
+	test_write();
+	test_unmap();
+	test_writefrom();
+	test_bad();
+	remove(TESTFILE);
+	printf("Passed mmaptest.\n");
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * rlimittest - test getrlimit() and setrlimit().
+ *
+ * Checks the rules for changing limits, that RLIMIT_DATA stops sbrk,
+ * and that a child over its RLIMIT_RSS either pages against itself,
+ * keeping its data, or, with nowhere to page to, is killed.
+ *
+ * With the argument "oom", also runs a child that allocates memory
+ * until the system runs out and checks that it gets killed. This
+ * takes a while when there is a lot of swap.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#define PAGE_SIZE	4096
+#define RSSPAGES	16
+#define NPAGES		64
+
+static char pages[NPAGES * PAGE_SIZE];
+
+static
+void
+getlimit(int resource, struct rlimit *rl)
+{
+	if (getrlimit(resource, rl) < 0) {
+		err(1, "getrlimit");
+	}
+}
+
+static
+void
+setlimit(int resource, const struct rlimit *rl)
+{
+	if (setrlimit(resource, rl) < 0) {
+		err(1, "setrlimit");
+	}
+}
+
+/*
+ * Fork, run func in the child, and return the child's wait status.
+ */
+static
+int
+runchild(void (*func)(void))
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		func();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	return status;
+}
+
+/*
+ * Bad requests: an unsupported limit, a soft limit above the hard
+ * limit, and raising the hard limit.
+ */
+static
+void
+test_rules(void)
+{
+	struct rlimit rl, orig;
+
+	printf("Checking limit rules...\n");
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		errx(1, "FAILED: getrlimit(RLIMIT_NOFILE) succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "FAILED: getrlimit(RLIMIT_NOFILE): wrong error");
+	}
+
+	getlimit(RLIMIT_DATA, &orig);
+	if (orig.rlim_cur > orig.rlim_max) {
+		errx(1, "FAILED: soft limit above hard limit");
+	}
+
+	rl.rlim_cur = PAGE_SIZE * 2;
+	rl.rlim_max = PAGE_SIZE;
+	if (setrlimit(RLIMIT_DATA, &rl) == 0) {
+		errx(1, "FAILED: soft limit above hard limit accepted");
+	}
+	if (errno != EINVAL) {
+		err(1, "FAILED: soft limit above hard limit: wrong error");
+	}
+
+	/* Lowering the hard limit is allowed, but only once. */
+	rl.rlim_cur = orig.rlim_cur;
+	rl.rlim_max = orig.rlim_max - 1;
+	if (rl.rlim_cur > rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+	}
+	setlimit(RLIMIT_DATA, &rl);
+	if (setrlimit(RLIMIT_DATA, &orig) == 0) {
+		errx(1, "FAILED: raising the hard limit succeeded");
+	}
+	if (errno != EPERM) {
+		err(1, "FAILED: raising the hard limit: wrong error");
+	}
+
+	getlimit(RLIMIT_DATA, &orig);
+	if (orig.rlim_max != rl.rlim_max) {
+		errx(1, "FAILED: hard limit not kept");
+	}
+}
+
+/*
+ * With no room for data, sbrk can give nothing out; with the soft
+ * limit raised back up it can again.
+ */
+static
+void
+test_data(void)
+{
+	struct rlimit rl, orig;
+	void *p;
+
+	printf("Checking RLIMIT_DATA...\n");
+
+	getlimit(RLIMIT_DATA, &orig);
+	rl.rlim_cur = 0;
+	rl.rlim_max = orig.rlim_max;
+	setlimit(RLIMIT_DATA, &rl);
+
+	p = sbrk(PAGE_SIZE);
+	if (p != (void *)-1) {
+		errx(1, "FAILED: sbrk past RLIMIT_DATA succeeded");
+	}
+	if (errno != ENOMEM) {
+		err(1, "FAILED: sbrk past RLIMIT_DATA: wrong error");
+	}
+
+	setlimit(RLIMIT_DATA, &orig);
+	p = sbrk(PAGE_SIZE);
+	if (p == (void *)-1) {
+		err(1, "FAILED: sbrk after raising RLIMIT_DATA");
+	}
+	if (sbrk(-PAGE_SIZE) == (void *)-1) {
+		err(1, "sbrk");
+	}
+}
+
+static
+void
+rsschild(void)
+{
+	struct rlimit rl;
+	struct rusage before, after;
+	unsigned long nswap;
+	unsigned i;
+
+	if (getrusage(RUSAGE_SELF, &before) < 0) {
+		err(1, "getrusage");
+	}
+
+	getlimit(RLIMIT_RSS, &rl);
+	rl.rlim_cur = RSSPAGES * PAGE_SIZE;
+	setlimit(RLIMIT_RSS, &rl);
+
+	for (i=0; i<NPAGES; i++) {
+		pages[i * PAGE_SIZE] = i;
+	}
+	for (i=0; i<NPAGES; i++) {
+		if (pages[i * PAGE_SIZE] != (char)i) {
+			errx(1, "FAILED: page %u lost its data", i);
+		}
+	}
+
+	/* Past the limit, each new page has to push out an old one */
+	if (getrusage(RUSAGE_SELF, &after) < 0) {
+		err(1, "getrusage");
+	}
+	nswap = (unsigned long)(after.ru_nswap - before.ru_nswap);
+	if (nswap < NPAGES - RSSPAGES) {
+		errx(1, "FAILED: RLIMIT_RSS not enforced (%lu pages swapped)",
+		     nswap);
+	}
+}
+
+/*
+ * Touch more pages than RLIMIT_RSS allows in a child.
+ */
+static
+void
+test_rss(void)
+{
+	int status;
+
+	printf("Checking RLIMIT_RSS...\n");
+
+	status = runchild(rsschild);
+	if (WIFSIGNALED(status)) {
+		printf("Child was killed with signal %d (no swap?)\n",
+		       WTERMSIG(status));
+	}
+	else if (WEXITSTATUS(status) != 0) {
+		errx(1, "FAILED: child exited with %d", WEXITSTATUS(status));
+	}
+}
+
+static
+void
+oomchild(void)
+{
+	char *p;
+
+	while (1) {
+		p = sbrk(PAGE_SIZE);
+		if (p == (void *)-1) {
+			err(1, "sbrk");
+		}
+		*p = 1;
+	}
+}
+
+/*
+ * Run a child out of memory; it should be killed rather than the
+ * system hang or the child see an error.
+ */
+static
+void
+test_oom(void)
+{
+	int status;
+
+	printf("Running a child out of memory...\n");
+
+	status = runchild(oomchild);
+	if (!WIFSIGNALED(status)) {
+		errx(1, "FAILED: child exited with %d", WEXITSTATUS(status));
+	}
+	printf("Child was killed with signal %d\n", WTERMSIG(status));
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_rules();
+	test_data();
+	test_rss();
+	if (argc > 1 && !strcmp(argv[1], "oom")) {
+		test_oom();
+	}
+	printf("Passed rlimittest.\n");
+	return 0;
+}
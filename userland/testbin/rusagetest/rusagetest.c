@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * rusagetest - test getrusage().
+ *
+ * Touches pages nobody has used yet and checks that the fault counts
+ * go up, and that the calls getrusage does not support are refused.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <err.h>
+#include <errno.h>
+
+#define PAGE_SIZE	4096
+#define NPAGES		64
+
+static char pages[NPAGES * PAGE_SIZE];
+
+static
+void
+getusage(struct rusage *ru)
+{
+	if (getrusage(RUSAGE_SELF, ru) < 0) {
+		err(1, "getrusage");
+	}
+}
+
+static
+void
+printusage(const char *when, const struct rusage *ru)
+{
+	printf("%s: %lu minor faults, %lu major faults, %lu swaps\n", when,
+	       (unsigned long)ru->ru_minflt, (unsigned long)ru->ru_majflt,
+	       (unsigned long)ru->ru_nswap);
+}
+
+int
+main(void)
+{
+	struct rusage before, after;
+	unsigned i;
+
+	getusage(&before);
+	printusage("Before", &before);
+
+	/* Write each page so it needs a page of its own. */
+	for (i=0; i<NPAGES; i++) {
+		pages[i * PAGE_SIZE] = i;
+	}
+
+	getusage(&after);
+	printusage("After", &after);
+
+	/*
+	 * Fault-around may map several pages per fault, so only ask for
+	 * some progress, not one fault per page.
+	 */
+	if (after.ru_minflt + after.ru_majflt <=
+	    before.ru_minflt + before.ru_majflt) {
+		errx(1, "FAILED: touching %d pages took no faults", NPAGES);
+	}
+	if (after.ru_minflt < before.ru_minflt ||
+	    after.ru_majflt < before.ru_majflt ||
+	    after.ru_nswap < before.ru_nswap) {
+		errx(1, "FAILED: a counter went backwards");
+	}
+
+	if (getrusage(RUSAGE_CHILDREN, &after) == 0) {
+		errx(1, "FAILED: getrusage(RUSAGE_CHILDREN) succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "FAILED: getrusage(RUSAGE_CHILDREN): wrong error");
+	}
+
+	if (getrusage(RUSAGE_SELF, NULL) == 0) {
+		errx(1, "FAILED: getrusage with a null pointer succeeded");
+	}
+	if (errno != EFAULT) {
+		err(1, "FAILED: getrusage with a null pointer: wrong error");
+	}
+
+	printf("Passed rusagetest.\n");
+	return 0;
+}
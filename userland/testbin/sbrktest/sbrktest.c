@@ -1062,6 +1062,47 @@ test21(void)
 	stresstest(geti(), true);
 }
 
+////////////////////////////////////////////////////////////
+// bad arguments
+
+/*
+ * Allocates some pages and tries to free more than the whole heap
+ * (more than the address of its end, which is surely more than its
+ * size); this should fail with EINVAL and leave the heap as it was.
+ */
+static
+void
+test22(void)
+{
+	void *start, *p;
+	int error;
+
+	start = dosbrk(0);
+	p = dosbrk(PAGE_SIZE * 3);
+	markpagelight(p, 0);
+
+	printf("Freeing more than was allocated...\n");
+	p = sbrk(-(intptr_t)((uintptr_t)start + PAGE_SIZE * 4));
+	error = errno;
+	if (p != (void *)-1) {
+		errx(1, "FAILED: sbrk succeeded");
+	}
+	if (error != EINVAL) {
+		errx(1, "FAILED: sbrk gave %s instead of EINVAL",
+		     strerror(error));
+	}
+	if (dosbrk(0) != (char *)start + PAGE_SIZE * 3) {
+		errx(1, "FAILED: the heap end moved");
+	}
+
+	if (checkpagelight(start, 0, false)) {
+		errx(1, "FAILED: data corrupt");
+	}
+
+	(void)dosbrk(-(PAGE_SIZE * 3));
+	printf("Passed sbrk test 22.\n");
+}
+
 ////////////////////////////////////////////////////////////
 // main
 
@@ -1091,6 +1132,7 @@ static const struct {
 	{ 19, "Large stress test", test19 },
 	{ 20, "Randomized large stress test", test20 },
 	{ 21, "Large stress test with particular seed", test21 },
+	{ 22, "Free more than was allocated (fails)", test22 },
 };
 static const unsigned numtests = sizeof(tests) / sizeof(tests[0]);
 
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * vforktest - test vfork().
+ *
+ * The child shares the parent's memory until it calls execv or
+ * _exit, and the parent waits until then; the file table is not
+ * shared. Checks all three, and that a child whose execv fails can
+ * still exit cleanly.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+static volatile int shared;
+
+/*
+ * Wait for pid and check that it exited with the given code.
+ */
+static
+void
+checkexit(pid_t pid, int code, const char *what)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (WIFSIGNALED(status)) {
+		errx(1, "FAILED: %s: child got signal %d", what,
+		     WTERMSIG(status));
+	}
+	if (WEXITSTATUS(status) != code) {
+		errx(1, "FAILED: %s: child exited with %d, not %d", what,
+		     WEXITSTATUS(status), code);
+	}
+}
+
+/*
+ * The child's stores are seen by the parent, which does not run
+ * until the child is gone; the child closing a file does not close
+ * it for the parent.
+ */
+static
+void
+test_shared(void)
+{
+	static const char msg[] = "Parent's stdout still open.\n";
+	pid_t pid;
+	int r;
+
+	printf("Checking shared memory...\n");
+	shared = 0;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		shared = 1;
+		close(STDOUT_FILENO);
+		_exit(0);
+	}
+	if (shared != 1) {
+		errx(1, "FAILED: parent did not see the child's store");
+	}
+	checkexit(pid, 0, "shared memory");
+
+	/* printf would ignore a closed stdout, so use write directly */
+	r = write(STDOUT_FILENO, msg, strlen(msg));
+	if (r != (int)strlen(msg)) {
+		errx(1, "FAILED: child's close closed the parent's stdout");
+	}
+}
+
+static
+void
+test_exec(void)
+{
+	char *args[2];
+	pid_t pid;
+
+	printf("Checking exec...\n");
+	args[0] = (char *)"true";
+	args[1] = NULL;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		execv("/bin/true", args);
+		_exit(1);
+	}
+	checkexit(pid, 0, "exec /bin/true");
+}
+
+static
+void
+test_execfail(void)
+{
+	char *args[2];
+	pid_t pid;
+
+	printf("Checking failed exec...\n");
+	args[0] = (char *)"nonexistent";
+	args[1] = NULL;
+	pid = vfork();
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		execv("/bin/nonexistent", args);
+		_exit(42);
+	}
+	checkexit(pid, 42, "failed exec");
+}
+
+int
+main(void)
+{
+	test_shared();
+	test_exec();
+	test_execfail();
+	printf("Passed vforktest.\n");
+	return 0;
+}